@@ -0,0 +1,128 @@
+/* Times source/table.c on its own, away from the VM, and prints how many bytes a table of each
+   size takes. Build and run it from the top of the repo with:
+
+     cc -O2 -Isource -o tablebench misc/tablebench.c source/table.c && ./tablebench
+
+   Each size is run 5 times and the best time kept, in nanoseconds per operation. Misses look up
+   keys that were never added, through both tableGet() and tableFindString(). */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "memory.h"
+#include "object.h"
+#include "table.h"
+#include "value.h"
+
+#define RUNS 5
+#define LOOKUPS 20000000L
+
+static long liveBytes = 0;
+
+/* table.c only allocates through reallocate(), so this stands in for the collector's. */
+void *reallocate(void *pointer, size_t oldSize, size_t newSize, VM *vm) {
+  liveBytes += (long)newSize - (long)oldSize;
+  if (newSize == 0) {
+    free(pointer);
+    return NULL;
+  }
+  return realloc(pointer, newSize);
+}
+
+void printValue(Value value) {}
+
+static uint32_t hashString(const char *key, int length) {
+  uint32_t hash = 2166136261u;
+  for (int i = 0; i < length; i++) {
+    hash ^= (uint8_t)key[i];
+    hash *= 16777619;
+  }
+  return hash;
+}
+
+static ObjString *makeKey(const char *prefix, int i) {
+  char buffer[32];
+  int length = snprintf(buffer, sizeof(buffer), "%s%d", prefix, i);
+  ObjString *key = calloc(1, sizeof(ObjString) + length + 1);
+  key->length = length;
+  memcpy(key->chars, buffer, length + 1);
+  key->hash = hashString(buffer, length);
+  return key;
+}
+
+static double now() {
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+int main() {
+  int sizes[] = {8, 64, 1000, 100000, 1000000, 10000000};
+  int sizeCount = sizeof(sizes) / sizeof(sizes[0]);
+  double best[sizeof(sizes) / sizeof(sizes[0])][4];
+  long bytes[sizeof(sizes) / sizeof(sizes[0])];
+  long found = 0;
+
+  for (int s = 0; s < sizeCount; s++) {
+    for (int m = 0; m < 4; m++) best[s][m] = 1e9;
+  }
+
+  for (int run = 0; run < RUNS; run++) {
+    for (int s = 0; s < sizeCount; s++) {
+      int count = sizes[s];
+      ObjString **keys = malloc(sizeof(ObjString *) * count);
+      ObjString **misses = malloc(sizeof(ObjString *) * count);
+      for (int i = 0; i < count; i++) {
+        keys[i] = makeKey("key", i);
+        misses[i] = makeKey("miss", i);
+      }
+      int rounds = count >= LOOKUPS ? 1 : LOOKUPS / count;
+      long operations = (long)rounds * count;
+      Value value;
+      Table table;
+      initTable(&table);
+      liveBytes = 0;
+
+      double start = now();
+      for (int i = 0; i < count; i++) tableSet(&table, keys[i], NUMBER_VAL(i), NULL);
+      double inserted = now();
+      bytes[s] = liveBytes;
+      for (int r = 0; r < rounds; r++) {
+        for (int i = 0; i < count; i++) found += tableGet(&table, keys[i], &value);
+      }
+      double hit = now();
+      for (int r = 0; r < rounds; r++) {
+        for (int i = 0; i < count; i++) found += tableGet(&table, misses[i], &value);
+      }
+      double missed = now();
+      for (int r = 0; r < rounds; r++) {
+        for (int i = 0; i < count; i++) {
+          found += tableFindString(&table, misses[i]->chars, misses[i]->length, misses[i]->hash) != NULL;
+        }
+      }
+      double searched = now();
+
+      double times[4] = {(inserted - start) / count * 1e9, (hit - inserted) / operations * 1e9,
+                         (missed - hit) / operations * 1e9, (searched - missed) / operations * 1e9};
+      for (int m = 0; m < 4; m++) {
+        if (times[m] < best[s][m]) best[s][m] = times[m];
+      }
+
+      freeTable(&table, NULL);
+      for (int i = 0; i < count; i++) {
+        free(keys[i]);
+        free(misses[i]);
+      }
+      free(keys);
+      free(misses);
+    }
+  }
+
+  printf("%9s %8s %8s %8s %20s %12s\n", "entries", "insert", "hit", "miss", "tableFindString miss", "bytes");
+  for (int s = 0; s < sizeCount; s++) {
+    printf("%9d %8.1f %8.1f %8.1f %20.1f %12ld\n", sizes[s], best[s][0], best[s][1], best[s][2], best[s][3], bytes[s]);
+  }
+  /* Keeps the lookups from being optimized away. */
+  return found < 0;
+}
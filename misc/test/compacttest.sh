@@ -0,0 +1,28 @@
+#!/bin/sh
+# Runs compacttest.tlx with compaction on, alone and next to the other collector options, and
+# checks it comes out the same as without and that a compaction really did happen. Run it from the
+# top of the repo after make, optionally with the joint to test: sh misc/test/compacttest.sh [JOINT]
+JOINT=${1:-./joint}
+SCRIPT=misc/test/compacttest.tlx
+EXPECTED="252500, 252700, 100
+121
+19799, p
+true
+7, p, held, 101, 102
+27503"
+failed=0
+
+# A small heap that grows slowly, so full collections, and compactions after them, come often.
+HEAP="--gc-initial-heap 64K --gc-growth 1.1"
+for options in "--gc-compact 0.5" "--gc-compact 0.01" "--gc-compact 0.5 --gc-pause 50" \
+	       "--gc-compact 0.5 --gc-threads 4"; do
+  output=$(echo compact | "$JOINT" $SCRIPT $options $HEAP 2>&1)
+  if [ "$output" != "$EXPECTED" ]; then
+    echo "FAILED: $options"
+    echo "$output"
+    failed=1
+  fi
+done
+
+[ $failed -eq 0 ] && echo "compaction tests passed"
+exit $failed
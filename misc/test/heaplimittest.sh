@@ -0,0 +1,56 @@
+#!/bin/sh
+# Runs heaplimittest.tlx the ways a heap limit can be set. Run it from the top of the repo after
+# make, optionally with the joint to test: sh misc/test/heaplimittest.sh [JOINT]
+JOINT=${1:-./joint}
+SCRIPT=misc/test/heaplimittest.tlx
+LIMIT_ERROR="Out of memory, the heap grew past its limit."
+failed=0
+
+fail() {
+  echo "FAILED: $1"
+  failed=1
+}
+
+# Garbage is collected to stay under the limit, so the script finishes.
+output=$(echo | "$JOINT" $SCRIPT --max-heap 64M 2>&1)
+[ "$output" = "101" ] || fail "--max-heap with only garbage: $output"
+output=$(echo | JOINT_MAX_HEAP=64M "$JOINT" $SCRIPT 2>&1)
+[ "$output" = "101" ] || fail "JOINT_MAX_HEAP with only garbage: $output"
+
+# Holding on to everything goes past the limit, which is a runtime error rather than an exit.
+output=$(echo hoard | "$JOINT" $SCRIPT --max-heap 64M 2>&1)
+status=$?
+case "$output" in
+  *"$LIMIT_ERROR"*) [ $status -eq 0 ] || fail "--max-heap exited with $status" ;;
+  *) fail "--max-heap didn't raise the runtime error: $output" ;;
+esac
+output=$(echo hoard | JOINT_MAX_HEAP=64M "$JOINT" $SCRIPT 2>&1)
+status=$?
+case "$output" in
+  *"$LIMIT_ERROR"*) [ $status -eq 0 ] || fail "JOINT_MAX_HEAP exited with $status" ;;
+  *) fail "JOINT_MAX_HEAP didn't raise the runtime error: $output" ;;
+esac
+
+# Natives allocate against the same limit.
+output=$(echo arrays | "$JOINT" $SCRIPT --max-heap 64M 2>&1)
+case "$output" in
+  *"$LIMIT_ERROR"*) ;;
+  *) fail "--max-heap didn't stop the natives: $output" ;;
+esac
+
+# The command line wins over the environment.
+output=$(echo hoard | JOINT_MAX_HEAP=64M "$JOINT" $SCRIPT --max-heap 1G 2>&1)
+[ "$output" = "101" ] || fail "--max-heap didn't override JOINT_MAX_HEAP: $output"
+
+echo | "$JOINT" $SCRIPT --max-heap lots > /dev/null 2>&1
+[ $? -eq 64 ] || fail "a bad --max-heap wasn't a usage error"
+echo | JOINT_MAX_HEAP=lots "$JOINT" $SCRIPT > /dev/null 2>&1
+[ $? -eq 64 ] || fail "a bad JOINT_MAX_HEAP wasn't a usage error"
+
+# With no limit and a first collection that never comes, malloc() failing is the only thing that
+# can make room, and the script has to finish on the full collection and second try it gets.
+output=$(ulimit -v 150000; echo | "$JOINT" $SCRIPT --gc-initial-heap 1G 2>&1)
+[ "$output" = "101" ] || fail "no retry after a failed allocation: $output"
+
+[ $failed -eq 0 ] && echo "heap limit tests passed"
+exit $failed
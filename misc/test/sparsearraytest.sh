@@ -0,0 +1,24 @@
+#!/bin/sh
+# Runs sparsearraytest.tlx with and without --debug stress-gc, and checks that reading past the end
+# of a sparse array stops the script. Run it from the top of the repo after make, optionally with
+# the joint to test: sh misc/test/sparsearraytest.sh [JOINT]
+JOINT=${1:-./joint}
+failed=0
+
+fail() {
+  echo "FAILED: $1"
+  failed=1
+}
+
+output=$("$JOINT" misc/test/sparsearraytest.tlx 2>&1)
+[ $? -eq 0 ] || fail "sparsearraytest.tlx didn't finish: $output"
+stressed=$("$JOINT" misc/test/sparsearraytest.tlx --debug stress-gc 2>&1)
+[ "$stressed" = "$output" ] || fail "--debug stress-gc changed the output: $stressed"
+
+output=$("$JOINT" misc/test/sparsearrayreadtest.tlx 2>&1)
+status=$?
+[ $status -eq 1 ] || fail "reading past the end exited with $status"
+[ "$output" = "Out of bounds read of value array." ] || fail "reading past the end printed: $output"
+
+[ $failed -eq 0 ] && echo "sparse array tests passed"
+exit $failed
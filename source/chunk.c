@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <stddef.h>
 #include <stdlib.h>
+#include <math.h>
 
 #include "common.h"
 #include "object.h"
@@ -48,12 +49,28 @@ static int longConstantInstruction(char *name, Chunk *chunk, int offset) {
   return offset + 3;
 }
 
+static int tableInstruction(char *name, Chunk *chunk, int offset, int isLong) {
+  uint16_t constant = isLong ? getLongFromChunk(chunk, offset + 1) : getFromChunk(chunk, offset + 1);
+  int cacheOffset = offset + (isLong ? 3 : 2);
+  uint16_t cache = getLongFromChunk(chunk, cacheOffset);
+  printf("%-16s %4d '", name, constant);
+  printValue(getFromValueArray(&chunk->constants, (int) constant));
+  printf("' cache %d\n", cache);
+  return cacheOffset + 2;
+}
+
 static int byteInstruction(char *name, Chunk *chunk, int offset) {
   uint8_t slot = getFromChunk(chunk, offset + 1);
   printf("%-16s %4d\n", name, slot);
   return offset + 2; 
 }
 
+static int shortInstruction(char *name, Chunk *chunk, int offset) {
+  uint16_t slot = getLongFromChunk(chunk, offset + 1);
+  printf("%-16s %4d\n", name, slot);
+  return offset + 3;
+}
+
 static int jumpInstruction(char *name, int sign, Chunk *chunk, int offset) {
   uint16_t jump = (uint16_t) (chunk->code[offset+1] << 8);
   jump |= chunk->code[offset+2];
@@ -61,6 +78,13 @@ static int jumpInstruction(char *name, int sign, Chunk *chunk, int offset) {
   return offset + 3;
 }
 
+static int eachInstruction(char *name, Chunk *chunk, int offset) {
+  uint8_t slot = getFromChunk(chunk, offset + 1);
+  uint16_t jump = getLongFromChunk(chunk, offset + 2);
+  printf("%-16s %4d -> %d\n", name, slot, offset + 4 + jump);
+  return offset + 4;
+}
+
 void initChunk(Chunk *chunk) {
   chunk->count = 0;
   chunk->capacity = 0;
@@ -71,6 +95,10 @@ void initChunk(Chunk *chunk) {
   chunk->jumpTables.count = 0;
   chunk->jumpTables.capacity = 0;
   chunk->jumpTables.tables = NULL;
+
+  chunk->cacheCount = 0;
+  chunk->cacheCapacity = 0;
+  chunk->caches = NULL;
 }
 
 void writeChunk(Chunk *chunk, uint8_t byte, int line, VM *vm) {  
@@ -91,9 +119,13 @@ void freeChunk(Chunk *chunk, VM *vm) {
   FREE_ARRAY(int, chunk->lines, chunk->capacity, vm);
   freeValueArray(&chunk->constants, vm);
   for (int i = 0; i < chunk->jumpTables.count; i++) {
-    freeTable(&chunk->jumpTables.tables[i], vm);
+    JumpTable *table = &chunk->jumpTables.tables[i];
+    FREE_ARRAY(JumpCase, table->cases, table->caseCapacity, vm);
+    FREE_ARRAY(int, table->dense, table->denseCount, vm);
+    FREE_ARRAY(JumpCase, table->strings, table->stringCapacity, vm);
   }
-  FREE_ARRAY(Table, chunk->jumpTables.tables, chunk->jumpTables.capacity, vm);
+  FREE_ARRAY(JumpTable, chunk->jumpTables.tables, chunk->jumpTables.capacity, vm);
+  FREE_ARRAY(InlineCache, chunk->caches, chunk->cacheCapacity, vm);
   initChunk(chunk); 
 }
 
@@ -108,15 +140,49 @@ int addJumpTable(Chunk *chunk, VM *vm) {
   if (chunk->jumpTables.capacity < chunk->jumpTables.count + 1) {
     int oldCapacity = chunk->jumpTables.capacity;
     chunk->jumpTables.capacity = GROW_CAPACITY(oldCapacity);
-    chunk->jumpTables.tables = GROW_ARRAY(Table, chunk->jumpTables.tables, oldCapacity, chunk->jumpTables.capacity, vm);
+    chunk->jumpTables.tables = GROW_ARRAY(JumpTable, chunk->jumpTables.tables, oldCapacity, chunk->jumpTables.capacity, vm);
   }
   
-  initTable(&chunk->jumpTables.tables[chunk->jumpTables.count]);
+  JumpTable *table = &chunk->jumpTables.tables[chunk->jumpTables.count];
+  table->defaultOffset = 0;
+  for (int i = 0; i < 3; i++) {
+    table->logicOffsets[i] = -1;
+  }
+  table->caseCount = 0;
+  table->caseCapacity = 0;
+  table->cases = NULL;
+  table->numberCount = 0;
+  table->denseMin = 0;
+  table->denseCount = 0;
+  table->dense = NULL;
+  table->stringMultiplier = 0;
+  table->stringShift = 0;
+  table->stringCapacity = 0;
+  table->strings = NULL;
   chunk->jumpTables.count++;
   return chunk->jumpTables.count - 1;
 }
 
-Table *getJumpTable(Chunk *chunk, uint8_t number) {
+/* Every fixed-key table access gets its own cache, so sites only ever see the shapes that
+   actually flow through them. */
+int addInlineCache(Chunk *chunk, VM *vm) {
+  if (chunk->cacheCapacity < chunk->cacheCount + 1) {
+    int oldCapacity = chunk->cacheCapacity;
+    chunk->cacheCapacity = GROW_CAPACITY(oldCapacity);
+    chunk->caches = GROW_ARRAY(InlineCache, chunk->caches, oldCapacity, chunk->cacheCapacity, vm);
+  }
+
+  InlineCache *cache = &chunk->caches[chunk->cacheCount];
+  for (int i = 0; i < INLINE_CACHE_WAYS; i++) {
+    cache->entries[i].shape = NULL;
+    cache->entries[i].transition = NULL;
+    cache->entries[i].slot = 0;
+  }
+  chunk->cacheCount++;
+  return chunk->cacheCount - 1;
+}
+
+JumpTable *getJumpTable(Chunk *chunk, uint8_t number) {
   if (chunk->jumpTables.count <= number) {
     fprintf(stderr, "Out of bounds read of jump table array.");
     exit(1);
@@ -125,6 +191,174 @@ Table *getJumpTable(Chunk *chunk, uint8_t number) {
   return &chunk->jumpTables.tables[number];
 }
 
+static int caseKeysEqual(Value a, Value b) {
+  if (IS_NUMBER(a) || IS_NUMBER(b)) return IS_NUMBER(a) && IS_NUMBER(b) && AS_NUMBER(a) == AS_NUMBER(b);
+  return IS_OBJECT(a) && IS_OBJECT(b) && AS_OBJECT(a) == AS_OBJECT(b); /* Strings are interned. */
+}
+
+/* Returns 0 if the switch already has a case for this key. */
+int addJumpCase(JumpTable *table, Value key, int offset, VM *vm) {
+  if (IS_LOGIC(key)) {
+    if (table->logicOffsets[AS_LOGIC(key)] != -1) return 0;
+    table->logicOffsets[AS_LOGIC(key)] = offset;
+    return 1;
+  }
+
+  for (int i = 0; i < table->caseCount; i++) {
+    if (caseKeysEqual(table->cases[i].key, key)) return 0;
+  }
+
+  push(getStack(vm), key);
+  if (table->caseCapacity < table->caseCount + 1) {
+    int oldCapacity = table->caseCapacity;
+    table->caseCapacity = GROW_CAPACITY(oldCapacity);
+    table->cases = GROW_ARRAY(JumpCase, table->cases, oldCapacity, table->caseCapacity, vm);
+  }
+  pop(getStack(vm));
+
+  table->cases[table->caseCount].key = key;
+  table->cases[table->caseCount].offset = offset;
+  table->caseCount++;
+  return 1;
+}
+
+static int caseBefore(Value a, Value b) {
+  if (IS_NUMBER(a) != IS_NUMBER(b)) return IS_NUMBER(a);
+  return IS_NUMBER(a) && AS_NUMBER(a) < AS_NUMBER(b);
+}
+
+static void buildDenseCases(JumpTable *table, VM *vm) {
+  if (table->numberCount < 2) return;
+  double min = AS_NUMBER(table->cases[0].key);
+  double max = AS_NUMBER(table->cases[table->numberCount - 1].key);
+  for (int i = 0; i < table->numberCount; i++) {
+    double number = AS_NUMBER(table->cases[i].key);
+    if (number != floor(number)) return;
+  }
+  if (min < INT32_MIN || max > INT32_MAX) return;
+  double range = max - min + 1;
+  if (range > UINT8_MAX + 1 || range > 2 * table->numberCount) return; /* Mostly holes, binary search it. */
+
+  int count = (int) range;
+  int *dense = ALLOCATE(int, count, vm);
+  for (int i = 0; i < count; i++) {
+    dense[i] = table->defaultOffset;
+  }
+  for (int i = 0; i < table->numberCount; i++) {
+    dense[(int) (AS_NUMBER(table->cases[i].key) - min)] = table->cases[i].offset;
+  }
+  table->denseMin = (int) min;
+  table->denseCount = count;
+  table->dense = dense;
+}
+
+static int tryStringMultiplier(JumpTable *table, uint32_t multiplier) {
+  for (int i = 0; i < table->stringCapacity; i++) {
+    table->strings[i].key = NIL_VAL;
+  }
+  for (int i = table->numberCount; i < table->caseCount; i++) {
+    uint32_t index = (AS_STRING(table->cases[i].key)->hash * multiplier) >> table->stringShift;
+    if (!IS_NIL(table->strings[index].key)) return 0;
+    table->strings[index] = table->cases[i];
+  }
+  return 1;
+}
+
+/* Looks for a multiplier that sends every case string to its own slot, so a lookup is one
+   multiply, one shift and one pointer compare. If none turns up, the string cases are left
+   for a linear search. */
+static void buildStringHash(JumpTable *table, VM *vm) {
+  int stringCount = table->caseCount - table->numberCount;
+  if (stringCount == 0) return;
+
+  int bits = 1;
+  while ((1 << bits) < 2 * stringCount) bits++;
+  for (int attempt = 0; attempt < 4; attempt++, bits++) {
+    int capacity = 1 << bits;
+    JumpCase *strings = ALLOCATE(JumpCase, capacity, vm);
+    table->strings = strings;
+    table->stringCapacity = capacity;
+    table->stringShift = 32 - bits;
+
+    uint32_t seed = 2654435761u;
+    for (int i = 0; i < 64; i++) {
+      uint32_t multiplier = seed | 1;
+      if (tryStringMultiplier(table, multiplier)) {
+	table->stringMultiplier = multiplier;
+	return;
+      }
+      seed = seed * 1664525u + 1013904223u;
+    }
+
+    FREE_ARRAY(JumpCase, table->strings, table->stringCapacity, vm);
+    table->strings = NULL;
+    table->stringCapacity = 0;
+  }
+}
+
+void finishJumpTable(JumpTable *table, int defaultOffset, VM *vm) {
+  table->defaultOffset = defaultOffset;
+  for (int i = 0; i < 3; i++) {
+    if (table->logicOffsets[i] == -1) table->logicOffsets[i] = defaultOffset;
+  }
+
+  for (int i = 1; i < table->caseCount; i++) {
+    JumpCase jumpCase = table->cases[i];
+    int j = i;
+    while (j > 0 && caseBefore(jumpCase.key, table->cases[j - 1].key)) {
+      table->cases[j] = table->cases[j - 1];
+      j--;
+    }
+    table->cases[j] = jumpCase;
+  }
+  table->numberCount = 0;
+  while (table->numberCount < table->caseCount && IS_NUMBER(table->cases[table->numberCount].key)) {
+    table->numberCount++;
+  }
+
+  buildDenseCases(table, vm);
+  buildStringHash(table, vm);
+}
+
+int jumpTableOffset(JumpTable *table, Value value) {
+  if (IS_STRING(value)) {
+    ObjString *string = AS_STRING(value);
+    if (table->strings != NULL) {
+      JumpCase *jumpCase = &table->strings[(string->hash * table->stringMultiplier) >> table->stringShift];
+      return IS_OBJECT(jumpCase->key) && AS_OBJECT(jumpCase->key) == (Object *)string ? jumpCase->offset : table->defaultOffset;
+    }
+    for (int i = table->numberCount; i < table->caseCount; i++) {
+      if (AS_OBJECT(table->cases[i].key) == (Object *)string) return table->cases[i].offset;
+    }
+    return table->defaultOffset;
+  }
+
+  if (IS_NUMBER(value)) {
+    double number = AS_NUMBER(value);
+    if (table->dense != NULL) {
+      double index = number - table->denseMin;
+      if (index >= 0 && index < table->denseCount && index == floor(index)) return table->dense[(int) index];
+      return table->defaultOffset;
+    }
+    int low = 0;
+    int high = table->numberCount - 1;
+    while (low <= high) {
+      int middle = (low + high) / 2;
+      double key = AS_NUMBER(table->cases[middle].key);
+      if (key == number) return table->cases[middle].offset;
+      if (key < number) {
+	low = middle + 1;
+      } else {
+	high = middle - 1;
+      }
+    }
+    return table->defaultOffset;
+  }
+
+  if (IS_LOGIC(value)) return table->logicOffsets[AS_LOGIC(value)];
+  return table->defaultOffset;
+}
+
 int disassembleInstruction(Chunk *chunk, int offset) {
   printf("%04d ", offset);
 
@@ -135,26 +369,26 @@ int disassembleInstruction(Chunk *chunk, int offset) {
   case OP_CONSTANT: return constantInstruction("OP_CONSTANT", chunk, offset);
   case OP_CONSTANT_16: return longConstantInstruction("OP_CONSTANT_16", chunk, offset);
   case OP_PUSH_1: return simpleInstruction("OP_PUSH_1", offset);
-  case OP_DEFINE_GLOBAL: return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
-  case OP_DEFINE_GLOBAL_16: return longConstantInstruction("OP_DEFINE_GLOBAL_16", chunk, offset);
+  case OP_DEFINE_GLOBAL: return byteInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+  case OP_DEFINE_GLOBAL_16: return shortInstruction("OP_DEFINE_GLOBAL_16", chunk, offset);
   case OP_COLLECT: return byteInstruction("OP_COLLECT", chunk, offset);
-  case OP_TABLE_SET: return constantInstruction("OP_TABLE_SET", chunk, offset);
-  case OP_TABLE_SET_16: return longConstantInstruction("OP_TABLE_SET_16", chunk, offset);
-  case OP_TABLE_GET: return constantInstruction("OP_TABLE_GET", chunk, offset);
-  case OP_TABLE_GET_16: return longConstantInstruction("OP_TABLE_GET_16", chunk, offset);
-  case OP_SET_GLOBAL: return constantInstruction("OP_SET_GLOBAL", chunk, offset);
-  case OP_SET_GLOBAL_16: return longConstantInstruction("OP_SET_GLOBAL_16", chunk, offset);
+  case OP_TABLE_SET: return tableInstruction("OP_TABLE_SET", chunk, offset, 0);
+  case OP_TABLE_SET_16: return tableInstruction("OP_TABLE_SET_16", chunk, offset, 1);
+  case OP_TABLE_GET: return tableInstruction("OP_TABLE_GET", chunk, offset, 0);
+  case OP_TABLE_GET_16: return tableInstruction("OP_TABLE_GET_16", chunk, offset, 1);
+  case OP_SET_GLOBAL: return byteInstruction("OP_SET_GLOBAL", chunk, offset);
+  case OP_SET_GLOBAL_16: return shortInstruction("OP_SET_GLOBAL_16", chunk, offset);
   case OP_SET_LOCAL: return byteInstruction("OP_SET_LOCAL", chunk, offset);
   case OP_SET_UPVALUE: return byteInstruction("OP_SET_UPVALUE", chunk, offset);
-  case OP_GET_GLOBAL: return constantInstruction("OP_GET_GLOBAL", chunk, offset);
-  case OP_GET_GLOBAL_16: return longConstantInstruction("OP_GET_GLOBAL_16", chunk, offset);
+  case OP_GET_GLOBAL: return byteInstruction("OP_GET_GLOBAL", chunk, offset);
+  case OP_GET_GLOBAL_16: return shortInstruction("OP_GET_GLOBAL_16", chunk, offset);
   case OP_GET_LOCAL: return byteInstruction("OP_GET_LOCAL", chunk, offset);
   case OP_GET_UPVALUE: return byteInstruction("OP_GET_UPVALUE", chunk, offset);
   case OP_CLOSE_UPVALUE: return simpleInstruction("OP_CLOSE_UPVALUE", offset);
   case OP_SET_ARRAY: return simpleInstruction("OP_SET_ARRAY", offset);
   case OP_GET_ARRAY: return simpleInstruction("OP_GET_ARRAY", offset);
-  case OP_GET_ARRAY_LOOP: return simpleInstruction("OP_GET_ARRAY_LOOP", offset);
-  case OP_GET_ARRAY_COUNT: return simpleInstruction("OP_GET_ARRAY_COUNT", offset);
+  case OP_EACH_NEXT: return eachInstruction("OP_EACH_NEXT", chunk, offset);
+  case OP_EACH_NEXT_KEY: return eachInstruction("OP_EACH_NEXT_KEY", chunk, offset);
   case OP_TABLE_CLC_SET: return simpleInstruction("OP_SET_TABLE", offset);
   case OP_TABLE_CLC_GET: return simpleInstruction("OP_GET_TABLE", offset);
   case OP_POP: return simpleInstruction("OP_POP", offset);
@@ -184,9 +418,19 @@ int disassembleInstruction(Chunk *chunk, int offset) {
   case OP_JUMP_TABLE_JUMP: {
     offset++;
     uint8_t tableNum = chunk->code[offset++];
-    printf("%-16s %4d ", "OP_JUMP_TABLE_JUMP", tableNum);
-    printTable(&chunk->jumpTables.tables[tableNum]);
-    printf("\n");    
+    JumpTable *table = &chunk->jumpTables.tables[tableNum];
+    printf("%-16s %4d [ ", "OP_JUMP_TABLE_JUMP", tableNum);
+    for (int i = 0; i < table->caseCount; i++) {
+      printValue(table->cases[i].key);
+      printf(" -> %d, ", offset + table->cases[i].offset);
+    }
+    for (int i = 0; i < 3; i++) {
+      if (table->logicOffsets[i] == table->defaultOffset) continue;
+      printValue(LOGIC_VAL(i));
+      printf(" -> %d, ", offset + table->logicOffsets[i]);
+    }
+    printf("default -> %d ]\n", offset + table->defaultOffset);
+    return offset;
   }
   case OP_LOOP: return jumpInstruction("OP_LOOP", -1, chunk, offset);
   case OP_CALL: return byteInstruction("OP_CALL", chunk, offset);
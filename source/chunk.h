@@ -6,6 +6,7 @@ typedef struct VM VM;
 #include <stddef.h>
 #include <stdint.h>
 
+#include "config.h"
 #include "value.h"
 #include "table.h"
 
@@ -55,9 +56,8 @@ typedef enum {
   OP_CLOSE_UPVALUE,
   OP_SET_ARRAY,
   OP_GET_ARRAY,
-  OP_GET_ARRAY_LOOP,
-  OP_GET_TABLE_LOOP,
-  OP_GET_ARRAY_COUNT,
+  OP_EACH_NEXT,
+  OP_EACH_NEXT_KEY,
   OP_TABLE_CLC_SET,
   OP_TABLE_CLC_GET,
   OP_JUMP,
@@ -73,11 +73,45 @@ typedef enum {
   OP_RETURN
 } OpCode;
 
+typedef struct {
+  Value key;
+  int offset;
+} JumpCase;
+
+/* The cases of one switch statement. The compiler adds cases as it goes and calls
+   finishJumpTable() once it's seen the whole switch. Offsets count from the end of the
+   OP_JUMP_TABLE_JUMP instruction. */
+typedef struct {
+  int defaultOffset;
+  int logicOffsets[3]; /* Indexed by TriloxLogic. */
+  int caseCount;
+  int caseCapacity;
+  JumpCase *cases; /* Number cases come first and in order, so they can be binary searched. */
+  int numberCount;
+  int denseMin; /* Whole number cases that fill most of a small range are looked up directly. */
+  int denseCount;
+  int *dense;
+  uint32_t stringMultiplier; /* String cases are placed with a perfect hash of their string hashes. */
+  int stringShift;
+  int stringCapacity;
+  JumpCase *strings;
+} JumpTable;
+
 typedef struct {
   int count;
   int capacity;
-  Table *tables;
-} TableArray;
+  JumpTable *tables;
+} JumpTableArray;
+
+typedef struct {
+  ObjShape *shape; /* NULL while the way is unused. */
+  ObjShape *transition; /* For a store that adds the key, the shape the table ends up with. */
+  int slot;
+} InlineCacheEntry;
+
+typedef struct {
+  InlineCacheEntry entries[INLINE_CACHE_WAYS];
+} InlineCache;
 
 typedef struct {
   int count;
@@ -85,7 +119,10 @@ typedef struct {
   uint8_t* code;
   ValueArray constants;
   int *lines;
-  TableArray jumpTables;
+  JumpTableArray jumpTables;
+  int cacheCount;
+  int cacheCapacity;
+  InlineCache *caches;
 } Chunk;
 
 void initChunk(Chunk *chunk);
@@ -94,7 +131,12 @@ void freeChunk(Chunk *chunk, VM *vm);
 void disassembleChunk(Chunk *chunk, char *name);
 
 int addJumpTable(Chunk *chunk, VM *vm);
-Table *getJumpTable(Chunk *chunk, uint8_t number);
+JumpTable *getJumpTable(Chunk *chunk, uint8_t number);
+int addJumpCase(JumpTable *table, Value key, int offset, VM *vm);
+void finishJumpTable(JumpTable *table, int defaultOffset, VM *vm);
+int jumpTableOffset(JumpTable *table, Value value);
+
+int addInlineCache(Chunk *chunk, VM *vm);
 
 int addConstant(Chunk *chunk, Value value, VM *vm);
 
@@ -328,6 +328,16 @@ static void emitVariableLength(uint16_t constant, OpCode op, OpCode op16) {
   }
 }
 
+static void emitTableAccess(uint16_t name, OpCode op, OpCode op16) {
+  int cache = addInlineCache(currentChunk(), vm);
+  if (cache > UINT16_MAX) {
+    errorAtCurrent("Too many table accesses in one function.");
+  }
+  emitVariableLength(name, op, op16);
+  emitByte((cache >> 8) & 0xff);
+  emitByte(cache & 0xff);
+}
+
 static void patchJump(int offset) {
   /* -2 to adjust for the bytecode for the jump offset itselt. */
   int jump = currentChunk()->count - offset - 2;
@@ -344,6 +354,16 @@ static uint16_t identifierConstant(Token *name) {
   return makeConstant(OBJECT_VAL(copyString(name->start, name->length, vm)));
 }
 
+static uint16_t identifierGlobal(Token *name) {
+  int slot = globalSlot(copyString(name->start, name->length, vm), vm);
+  if (slot > UINT16_MAX) {
+    errorAtCurrent("Too many global variables.");
+    return 0;
+  }
+
+  return (uint16_t) slot;
+}
+
 static void addLocal(Token name) {
   if (current->localCount > UINT8_MAX) {
     errorAtCurrent("Too many local variables in a function");
@@ -440,6 +460,7 @@ static ObjFunction *endCompiler() {
     disassembleChunk(currentChunk(), function->name != NULL ? function->name->chars : "<script>");
   }
   
+  writeBarrier((Object *)function, vm); /* It stops being a compiler root here, see markCompilerRoots(). */
   current = current->enclosing;
   return function;
 }
@@ -495,7 +516,7 @@ static uint16_t parseVariable(char *errorMessage) {
   declareVariable();
   if (current->scopeDepth > 0) return 0;
   
-  return identifierConstant(&parser.previous);
+  return identifierGlobal(&parser.previous);
 }
 
 static void markInitialized() {
@@ -843,28 +864,37 @@ static void eachStatement() {
   
   consume(TOKEN_DO, "Expect 'do' after loop variable");
 
+  /* The collection, the iterator's cursor and the table's starting size sit in locals the user
+     can't name. Having them as proper locals keeps any locals the body declares in the right slots. */
+  Token collectionToken = (Token) {TOKEN_IDENTIFIER, "(collection)", 12, 0};
+  Token cursorToken = (Token) {TOKEN_IDENTIFIER, "(cursor)", 8, 0};
+  Token sizeToken = (Token) {TOKEN_IDENTIFIER, "(size)", 6, 0};
+
+  addLocal(collectionToken);
+  markInitialized();
+  uint8_t loopCollection = current->localCount - 1;
+  emitByte(OP_NIL);
+  addLocal(cursorToken);
+  markInitialized();
+  emitByte(OP_NIL);
+  addLocal(sizeToken);
+  markInitialized();
   
   int loopStart = currentChunk()->count; /* Mark the loop start */
   current->loopStarts[current->loopLevel - 1] = loopStart;
   current->loopDepths[current->loopLevel - 1] = current->scopeDepth;
-  
-  emitByte(OP_GET_ARRAY_COUNT);
-  emitBytePair(OP_GET_LOCAL, loopCounter);
-  emitByte(OP_KP_GT_EQUAL); /* Compare the loop counter to the array count. */
-  
-  int exitJump = emitJump(OP_JUMP_IF_NOT_TRUE); /* Set up the exit jump. */
 
-  emitByte(OP_POP); /* Remove the comparison result from the stack. */
+  emitBytePair(loopKey != 0 ? OP_EACH_NEXT_KEY : OP_EACH_NEXT, loopCollection);
+  emitByte(0xff);
+  emitByte(0xff);
+  int exitJump = currentChunk()->count - 2; /* Where the loop ends up once it's out of entries. */
   
-  emitBytePair(OP_GET_LOCAL, loopCounter);
   if (loopKey != 0) {
-    emitByte(OP_GET_TABLE_LOOP);
     emitBytePair(OP_SET_LOCAL, loopVar); 
     emitByte(OP_POP);
     emitBytePair(OP_SET_LOCAL, loopKey);
     emitByte(OP_POP);
   } else {
-    emitByte(OP_GET_ARRAY_LOOP);
     emitBytePair(OP_SET_LOCAL, loopVar); /* Get the value from the array and put it in the loop variable. */
     emitByte(OP_POP);
   }
@@ -880,11 +910,8 @@ static void eachStatement() {
   
   patchJump(exitJump);
 
-  emitByte(OP_POP);
-  emitByte(OP_POP); /* Need two pops to get the array off the stack. */
-  
   current->loopLevel--;
-  closeBreaks();
+  closeBreaks(); /* Breaks land before the loop's locals get popped, same as running out of entries. */
   endScope();
 }
 
@@ -956,6 +983,23 @@ static void considerStatement() {
   }
 }
 
+static Value caseConditional() {
+  if (match(TOKEN_STRING)) {
+    return OBJECT_VAL(copyString(parser.previous.start + 1, parser.previous.length - 2, vm));
+  } else if (match(TOKEN_TRUE)) {
+    return LOGIC_VAL(TRILOX_TRUE);
+  } else if (match(TOKEN_UNKNOWN)) {
+    return LOGIC_VAL(TRILOX_UNKNOWN);
+  } else if (match(TOKEN_FALSE)) {
+    return LOGIC_VAL(TRILOX_FALSE);
+  }
+  
+  int negate = match(TOKEN_MINUS);
+  consume(TOKEN_NUMBER, "Expect string, number or logic value for case conditional.");
+  double value = strtod(parser.previous.start, NULL);
+  return NUMBER_VAL(negate ? -value : value);
+}
+
 static void switchStatement() {
   expression();
   consume(TOKEN_DO, "Expect 'do' after switch input.");
@@ -968,16 +1012,15 @@ static void switchStatement() {
     errorAtCurrent("Too many switch statements in function/script.");
   }
   
-  Table *jumpTable = getJumpTable(currentChunk(), jumpTableNum);
-  
   emitBytePair(OP_JUMP_TABLE_JUMP, (uint8_t) jumpTableNum);
 
   int switchStart = currentChunk()->count;
   
   while (match(TOKEN_CASE)) {
-    consume(TOKEN_STRING, "Expect string for case conditional.");
-    uint16_t stringNum = makeConstant(OBJECT_VAL(copyString(parser.previous.start + 1, parser.previous.length - 2, vm)));
-    int newConditional = tableSet(jumpTable, AS_STRING(currentChunk()->constants.values[stringNum]), NUMBER_VAL(currentChunk()->count - switchStart), vm);
+    Value conditional = caseConditional();
+    /* Look the jump table up every time, a switch inside one of the cases can move it. */
+    JumpTable *jumpTable = getJumpTable(currentChunk(), (uint8_t) jumpTableNum);
+    int newConditional = addJumpCase(jumpTable, conditional, currentChunk()->count - switchStart, vm);
     if (!newConditional) errorAtCurrent("Duplicate case conditional inside switch statement.");
     consume(TOKEN_DO, "Expect 'do' after case conditional.");
     emitByte(OP_POP);
@@ -991,17 +1034,15 @@ static void switchStatement() {
   }
   if (jumps == 0) errorAtCurrent("No 'case'-es inside switch statement!");
 
+  int defaultOffset = currentChunk()->count - switchStart;
   if (match(TOKEN_DEFAULT)) {
     consume(TOKEN_DO, "Expect 'do' after default case.");
-    uint16_t stringNum = makeConstant(OBJECT_VAL(copyString("___internal_switch_default", 26 , vm)));
-    tableSet(jumpTable, AS_STRING(currentChunk()->constants.values[stringNum]), NUMBER_VAL(currentChunk()->count - switchStart), vm);
     emitByte(OP_POP);
     statement();
   } else {
-    uint16_t stringNum = makeConstant(OBJECT_VAL(copyString("___internal_switch_default", 26 , vm)));
-    tableSet(jumpTable, AS_STRING(currentChunk()->constants.values[stringNum]), NUMBER_VAL(currentChunk()->count - switchStart), vm);
     emitByte(OP_POP);
   }
+  finishJumpTable(getJumpTable(currentChunk(), (uint8_t) jumpTableNum), defaultOffset, vm);
   
   for (int i = 0; i < jumps; i++) {
     patchJump(caseEndingJumps[i]);
@@ -1056,11 +1097,7 @@ static void table(tokenType endingType) {
       consume(TOKEN_COMMA, "Expect ',' between entries in table declaration");
     }
     /* Stack looks like this rn: <table>, <expression return value> */
-    if (identifier > UINT8_MAX) {
-      emitByteLong(OP_TABLE_SET_16, identifier);
-    } else { 
-      emitBytePair(OP_TABLE_SET, (uint8_t) identifier);
-    }
+    emitTableAccess(identifier, OP_TABLE_SET, OP_TABLE_SET_16);
     /* Both of these instructions must remove the return value from the stack,
        but leave the table on the stack. */
   }
@@ -1070,12 +1107,12 @@ static void table(tokenType endingType) {
 static void tableDeclaration() {
   uint16_t global = parseVariable("Expect table name.");
 
-  ObjTable *tableau = newTableObject(vm);
   if (match(TOKEN_DUPLICATE)) {
     consume(TOKEN_IDENTIFIER, "Expect table name after 'duplicate'.");
     variable(0);
     emitByte(OP_TABLE_DUPLICATE);
   } else {
+  ObjTable *tableau = newTableObject(vm);
   beginScope();
   emitConstant(OBJECT_VAL(tableau));
 
@@ -1185,18 +1222,10 @@ static void tableFixedAccess(int canAssign) {
   
   if (canAssign && match(TOKEN_ASSIGN)) {
     expression();
-    if (name > UINT8_MAX) {
-      emitByteLong(OP_TABLE_SET_16, name);
-    } else { 
-      emitBytePair(OP_TABLE_SET, (uint8_t) name);
-    }
+    emitTableAccess(name, OP_TABLE_SET, OP_TABLE_SET_16);
     checkEndStatement();
   } else {
-    if (name > UINT8_MAX) {
-      emitByteLong(OP_TABLE_GET_16, name);
-    } else { 
-      emitBytePair(OP_TABLE_GET, (uint8_t) name);
-    }
+    emitTableAccess(name, OP_TABLE_GET, OP_TABLE_GET_16);
   }
 }
 
@@ -1235,7 +1264,7 @@ static void namedVariable(Token name, int canAssign) {
     getOp = OP_GET_UPVALUE;
     setOp = OP_SET_UPVALUE;
   } else {
-    arg = identifierConstant(&name);
+    arg = identifierGlobal(&name);
     if (arg > UINT8_MAX) {
       getOp = OP_GET_GLOBAL_16;
       setOp = OP_SET_GLOBAL_16;
@@ -1377,6 +1406,8 @@ ObjFunction *compile(char *source, char *filename, VM *veem) {
   //  scan(source); /* This prints out the raw tokens our scanner produces from the source code. */
 
   vm = veem;
+  /* Everything a script is compiled into lives as long as the program, see allocateImmortal(). */
+  if (vm->immortalCode) vm->allocatingImmortal++;
   initScanner(source);
   Compiler compiler;
   initCompiler(&compiler, TYPE_SCRIPT);
@@ -1389,6 +1420,7 @@ ObjFunction *compile(char *source, char *filename, VM *veem) {
 
   emitReturn();
   ObjFunction *function = endCompiler();
+  if (vm->immortalCode) vm->allocatingImmortal--;
   
   return parser.hadError ? NULL : function;
 }
@@ -1396,7 +1428,9 @@ ObjFunction *compile(char *source, char *filename, VM *veem) {
 void markCompilerRoots() {
   Compiler *compiler = current;
   while (compiler != NULL) {
+    /* The compiler fills in functions without write barriers, so trace them even when they're old. */
     markObject((Object *)compiler->function, vm);
+    writeBarrier((Object *)compiler->function, vm);
     compiler = compiler->enclosing;
   }
 }
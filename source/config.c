@@ -4,3 +4,11 @@ int DEBUG_PRINT_BYTECODE = 0;
 int DEBUG_STRESS_GC = 0;
 int DEBUG_LOG_GC = 0;
 int DEBUG_PRINT_LIBRARY = 0;
+
+int GC_MAX_PAUSE = 0;
+int GC_THREADS = 1;
+size_t GC_INITIAL_HEAP = GC_DEFAULT_THRESHOLD;
+double GC_GROWTH_FACTOR = GC_HEAP_GROWTH_FACTOR;
+size_t GC_MAX_HEAP = 0;
+int GC_PRINT_STATS = 0;
+double GC_COMPACT_THRESHOLD = 0;
@@ -1,6 +1,8 @@
 #ifndef JOINT_CONFIG
 #define JOINT_CONFIG
 
+#include <stddef.h>
+
 /* debug config stuff */
 /* All of this stuff is going to be turned into command-line arguments for accessability. */
 
@@ -9,6 +11,15 @@ extern int DEBUG_STRESS_GC;
 extern int DEBUG_LOG_GC;
 extern int DEBUG_PRINT_LIBRARY;
 
+/* gc settings, set from the command line or the environment */
+extern int GC_MAX_PAUSE; /* Microseconds. 0 collects the whole heap in one go. */
+extern int GC_THREADS; /* How many threads mark the heap in a full collection. */
+extern size_t GC_INITIAL_HEAP; /* Bytes allocated before the first major collection. */
+extern double GC_GROWTH_FACTOR; /* The next major collection waits until the heap is this many times bigger. */
+extern size_t GC_MAX_HEAP; /* Bytes. 0 lets the heap grow until malloc gives up. */
+extern int GC_PRINT_STATS; /* Print the collector's stats as JSON when the VM is freed. */
+extern double GC_COMPACT_THRESHOLD; /* Compact once more than this fraction of the page memory is free cells. 0 never does. */
+
 /* internal stuff */
 #define FRAMES_MAX 64
 #define VM_STACK_MAX_SIZE (FRAMES_MAX * (UINT8_MAX + 1))
@@ -21,8 +32,72 @@ extern int DEBUG_PRINT_LIBRARY;
 
 #define TABLE_MAX_LOAD_FACTOR 0.75
 
-#define GC_DEFAULT_THRESHOLD 1024 * 1024
+/* Tables keep their keys in a shared shape until they grow past this many, then they switch over
+   to a private hash table. */
+#define SHAPE_MAX_SLOTS 256
+
+/* How many different shapes a single table access site remembers. */
+#define INLINE_CACHE_WAYS 4
+
+/* Adding strings together makes a rope instead of copying once the result is at least this long.
+   Shorter results are cheaper to copy straight away. */
+#define ROPE_MIN_LENGTH 64
+
+/* A store more than this many indices past the end of an array, and past twice its length, turns
+   it sparse instead of filling the gap with nils. It goes back to dense once at least half of its
+   indices are in use. */
+#define ARRAY_SPARSE_GAP 64
+
+/* Defaults for GC_INITIAL_HEAP and GC_GROWTH_FACTOR. */
+#define GC_DEFAULT_THRESHOLD (1024 * 1024)
 
 #define GC_HEAP_GROWTH_FACTOR 2
 
+/* Objects up to GC_MAX_CELL_SIZE bytes live in pages of same-sized cells, one size class every
+   GC_CELL_GRANULE bytes. Bigger ones are allocated on their own. The granule is as fine as the
+   alignment allows since the header is only 8 bytes, a short string fits in 24. */
+#define GC_PAGE_SIZE (16 * 1024)
+#define GC_CELL_GRANULE 8
+#define GC_MAX_CELL_SIZE 256
+#define GC_SIZE_CLASSES (GC_MAX_CELL_SIZE / GC_CELL_GRANULE)
+
+/* The immortal region grows by chunks of this many bytes, anything bigger gets a chunk of its own. */
+#define GC_REGION_SIZE (64 * 1024)
+
+/* A minor collection runs whenever this many bytes have been allocated since the last one. */
+#define GC_NURSERY_SIZE (256 * 1024)
+
+/* With incremental collection on, a slice of collection work runs every time this many bytes get
+   allocated, and runs until it has used up the pause. */
+#define GC_STEP_SIZE (64 * 1024)
+
+/* How many objects a slice gets through between checks of the clock. */
+#define GC_SLICE_WORK 64
+
+/* After a stop-the-world collection the dead objects are freed a few at a time by the allocations
+   that follow, this many objects per allocation. */
+#define GC_LAZY_SWEEP_WORK 16
+
+/* Full collections of heaps smaller than this are marked on one thread even if more are allowed,
+   starting the others up would take longer than the marking. */
+#define GC_PARALLEL_MIN_BYTES (8 * 1024 * 1024)
+
+/* A marking thread puts half of its gray objects up for grabs once it has more than this many and
+   none of its earlier ones are still up for grabs. */
+#define GC_SHARE_THRESHOLD 64
+
+#define GC_MAX_THREADS 64
+
+#define GC_HISTOGRAM_BUCKETS 24
+
+/* With stress-gc on, every allocation collects the young generation and every this many also
+   do a full collection. */
+#define GC_STRESS_MAJOR_INTERVAL 4
+
+/* Threaded dispatch in the VM's run loop relies on the labels-as-values extension, so it's only
+   turned on for compilers that have it. Build with -DJOINT_NO_COMPUTED_GOTO to use the plain switch. */
+#if defined(__GNUC__) && !defined(JOINT_NO_COMPUTED_GOTO)
+#define JOINT_COMPUTED_GOTO
+#endif
+
 #endif
@@ -3,26 +3,29 @@
 #include <stddef.h>
 #include <string.h>
 #include <time.h>
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #include "value.h"
 #include "object.h"
+#include "memory.h"
 #include "library.h"
 
-int LibraryFunctionCount = 4;
+int LibraryFunctionCount = 11;
+int LibraryABIVersion = 2;
 
-void *piNative(int argCount, Value *args) {
-  double *pi = malloc(sizeof(double));
-  *pi = 3.14159265358979323846;
-  return (void *) pi;
+Value piNative(int argCount, Value *args, VM *vm) {
+  return NUMBER_VAL(3.14159265358979323846);
 }
 
-void *clockNative(int argCount, Value *args) {
-  double *time = malloc(sizeof(double));
-  *time = (double) clock() / CLOCKS_PER_SEC;
-  return (void *)time;
+Value clockNative(int argCount, Value *args, VM *vm) {
+  return NUMBER_VAL((double) clock() / CLOCKS_PER_SEC);
 }
 
-void *displayNative(int argCount, Value *args) {
+Value displayNative(int argCount, Value *args, VM *vm) {
   for (int i = 0; i < argCount - 1; i++) {
     printValue(args[i]);
     printf(", ");
@@ -32,29 +35,299 @@ void *displayNative(int argCount, Value *args) {
   }
   printf("\n");
   
-  return NULL;
+  return NIL_VAL;
 }
 
-void *inputNative(int argCount, Value *args) {
+Value inputNative(int argCount, Value *args, VM *vm) {
   if (argCount > 0) {
-    displayNative(argCount, args);
+    displayNative(argCount, args, vm);
   }
   
   char *line = NULL;
   size_t linesize = 0;
-  size_t size = getline(&line, &linesize, stdin);
-  char *cleanline = malloc(size);
-  strncpy(cleanline, line, size); /* Remove the trailing newline*/
-  cleanline[size - 1] = '\0';
+  ssize_t size = getline(&line, &linesize, stdin);
+  if (size < 0) { /* Nothing left to read. */
+    free(line);
+    return NIL_VAL;
+  }
+  if (size > 0 && line[size - 1] == '\n') {
+    size--; /* Remove the trailing newline*/
+  }
+
+  char *chars = reserveString(size, vm);
+  memcpy(chars, line, size);
   free(line);
   
-  return (void *) cleanline;
+  return OBJECT_VAL(takeString(chars, size, vm));
+}
+
+/* weak(table, "v") makes a table's values weak and hands it back, see makeTableObjectWeak().
+   Weak keys ("k" or "kv") are an error, keys are strings and those are never let go of. Anything
+   else gets nil. */
+Value weakNative(int argCount, Value *args, VM *vm) {
+  if (argCount != 2 || !IS_TABLE(args[0]) || !IS_STRING(args[1])) return NIL_VAL;
+  char *mode = AS_CSTRING(args[1]);
+  if (strcmp(mode, "k") == 0 || strcmp(mode, "kv") == 0) {
+    vm->nativeError = "weak() can't make keys weak, they're strings, and weak tables keep strings.";
+    return NIL_VAL;
+  }
+  if (strcmp(mode, "v") != 0) return NIL_VAL;
+  makeTableObjectWeak(AS_TABLE(args[0]), WEAK_VALUES, vm);
+  return args[0];
+}
+
+/* The table being filled in is on top of the VM stack, so it survives the allocations. */
+static void setStat(char *key, Value value, VM *vm) {
+  VMStack *stack = getStack(vm);
+  push(stack, value);
+  ObjString *name = copyString(key, (int)strlen(key), vm);
+  push(stack, OBJECT_VAL(name));
+  setInTableObject(AS_TABLE(stack->top[-3]), name, value, vm);
+  pop(stack);
+  pop(stack);
+}
+
+static void setHistogramStat(char *key, GcHistogram *histogram, VM *vm) {
+  VMStack *stack = getStack(vm);
+  push(stack, OBJECT_VAL(newTableObject(vm)));
+  setStat("count", NUMBER_VAL(histogram->count), vm);
+  setStat("totalMicros", NUMBER_VAL(histogram->totalNanos / 1000.0), vm);
+  setStat("maxMicros", NUMBER_VAL(histogram->maxNanos / 1000.0), vm);
+  ObjArray *buckets = newArrayObject(vm);
+  push(stack, OBJECT_VAL(buckets));
+  for (int i = 0; i < GC_HISTOGRAM_BUCKETS; i++) {
+    setInArrayObject(buckets, NUMBER_VAL(i + 1), NUMBER_VAL(histogram->buckets[i]), vm);
+  }
+  setStat("buckets", pop(stack), vm);
+  setStat(key, pop(stack), vm);
+}
+
+/* The same numbers --gc-stats prints, laid out the same way, as a table. */
+Value gcStatsNative(int argCount, Value *args, VM *vm) {
+  GcStats *stats = &vm->stats;
+  VMStack *stack = getStack(vm);
+  push(stack, OBJECT_VAL(newTableObject(vm)));
+  setStat("minorCollections", NUMBER_VAL(stats->minorCollections), vm);
+  setStat("majorCollections", NUMBER_VAL(stats->majorCollections), vm);
+  setStat("bytesAllocated", NUMBER_VAL(vm->bytesAllocated), vm);
+  setStat("bytesFreed", NUMBER_VAL(stats->bytesFreed), vm);
+  setStat("internedStrings", NUMBER_VAL(internedStringCount(vm)), vm);
+  setStat("immortalBytes", NUMBER_VAL(stats->immortalBytes), vm);
+  setStat("compactions", NUMBER_VAL(stats->compactions), vm);
+  setStat("pagesReleased", NUMBER_VAL(stats->pagesReleased), vm);
+
+  ObjArray *limits = newArrayObject(vm);
+  push(stack, OBJECT_VAL(limits));
+  for (int i = 0; i < GC_HISTOGRAM_BUCKETS - 1; i++) {
+    setInArrayObject(limits, NUMBER_VAL(i + 1), NUMBER_VAL((uint64_t) 1 << i), vm);
+  }
+  setStat("bucketLimitsMicros", pop(stack), vm);
+
+  push(stack, OBJECT_VAL(newTableObject(vm)));
+  setHistogramStat("minor", &stats->minorPauses, vm);
+  setHistogramStat("major", &stats->majorPauses, vm);
+  setStat("pauses", pop(stack), vm);
+
+  push(stack, OBJECT_VAL(newTableObject(vm)));
+  setHistogramStat("mark", &stats->markTime, vm);
+  setHistogramStat("sweep", &stats->sweepTime, vm);
+  setHistogramStat("purge", &stats->purgeTime, vm);
+  setHistogramStat("compact", &stats->compactTime, vm);
+  setStat("phases", pop(stack), vm);
+
+  push(stack, OBJECT_VAL(newTableObject(vm)));
+  for (int type = 0; type < OBJ_TYPE_COUNT; type++) {
+    push(stack, OBJECT_VAL(newTableObject(vm)));
+    setStat("objects", NUMBER_VAL(stats->liveObjects[type]), vm);
+    setStat("bytes", NUMBER_VAL(stats->liveBytes[type]), vm);
+    setStat(objectTypeName(type), pop(stack), vm);
+  }
+  setStat("live", pop(stack), vm);
+  return pop(stack);
+}
+
+/* The kernels behind the array natives. Each one works through as many elements at a time as the
+   widest vectors it was built for hold (four with AVX, two with SSE2) and mops up the rest one by
+   one. Sums keep a few partial sums going, so they can come out a rounding error away from adding
+   the elements up in order. */
+static double sumKernel(double *x, int count) {
+  int i = 0;
+  double sum = 0;
+#if defined(__AVX__)
+  __m256d a = _mm256_setzero_pd(), b = _mm256_setzero_pd();
+  for (; i + 8 <= count; i += 8) {
+    a = _mm256_add_pd(a, _mm256_loadu_pd(x + i));
+    b = _mm256_add_pd(b, _mm256_loadu_pd(x + i + 4));
+  }
+  double lanes[4];
+  _mm256_storeu_pd(lanes, _mm256_add_pd(a, b));
+  sum = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+#elif defined(__SSE2__)
+  __m128d a = _mm_setzero_pd(), b = _mm_setzero_pd();
+  for (; i + 4 <= count; i += 4) {
+    a = _mm_add_pd(a, _mm_loadu_pd(x + i));
+    b = _mm_add_pd(b, _mm_loadu_pd(x + i + 2));
+  }
+  double lanes[2];
+  _mm_storeu_pd(lanes, _mm_add_pd(a, b));
+  sum = lanes[0] + lanes[1];
+#endif
+  for (; i < count; i++) sum += x[i];
+  return sum;
+}
+
+static double dotKernel(double *x, double *y, int count) {
+  int i = 0;
+  double sum = 0;
+#if defined(__AVX__)
+  __m256d a = _mm256_setzero_pd(), b = _mm256_setzero_pd();
+  for (; i + 8 <= count; i += 8) {
+    a = _mm256_add_pd(a, _mm256_mul_pd(_mm256_loadu_pd(x + i), _mm256_loadu_pd(y + i)));
+    b = _mm256_add_pd(b, _mm256_mul_pd(_mm256_loadu_pd(x + i + 4), _mm256_loadu_pd(y + i + 4)));
+  }
+  double lanes[4];
+  _mm256_storeu_pd(lanes, _mm256_add_pd(a, b));
+  sum = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+#elif defined(__SSE2__)
+  __m128d a = _mm_setzero_pd(), b = _mm_setzero_pd();
+  for (; i + 4 <= count; i += 4) {
+    a = _mm_add_pd(a, _mm_mul_pd(_mm_loadu_pd(x + i), _mm_loadu_pd(y + i)));
+    b = _mm_add_pd(b, _mm_mul_pd(_mm_loadu_pd(x + i + 2), _mm_loadu_pd(y + i + 2)));
+  }
+  double lanes[2];
+  _mm_storeu_pd(lanes, _mm_add_pd(a, b));
+  sum = lanes[0] + lanes[1];
+#endif
+  for (; i < count; i++) sum += x[i] * y[i];
+  return sum;
+}
+
+/* Whether 'candidate' should replace 'extreme'. NaNs never win, but anything beats a NaN, so
+   they're skipped and only an array of nothing but NaNs has one as its extreme. */
+static inline int beats(double candidate, double extreme, int wantMax) {
+  return extreme != extreme || (wantMax ? candidate > extreme : candidate < extreme);
+}
+
+/* 'count' has to be at least 1. The vector max and min hand back their second operand when either
+   one is NaN, so the new elements go first, and a lane that's still NaN takes them as they are. */
+static double extremeKernel(double *x, int count, int wantMax) {
+  int i = 0;
+  double extreme = x[0];
+#if defined(__AVX__)
+  if (count >= 4) {
+    __m256d m = _mm256_loadu_pd(x);
+    for (i = 4; i + 4 <= count; i += 4) {
+      __m256d v = _mm256_loadu_pd(x + i);
+      __m256d better = wantMax ? _mm256_max_pd(v, m) : _mm256_min_pd(v, m);
+      m = _mm256_blendv_pd(better, v, _mm256_cmp_pd(m, m, _CMP_UNORD_Q));
+    }
+    double lanes[4];
+    _mm256_storeu_pd(lanes, m);
+    for (int j = 0; j < 4; j++) {
+      if (beats(lanes[j], extreme, wantMax)) extreme = lanes[j];
+    }
+  }
+#elif defined(__SSE2__)
+  if (count >= 2) {
+    __m128d m = _mm_loadu_pd(x);
+    for (i = 2; i + 2 <= count; i += 2) {
+      __m128d v = _mm_loadu_pd(x + i);
+      __m128d better = wantMax ? _mm_max_pd(v, m) : _mm_min_pd(v, m);
+      __m128d unordered = _mm_cmpunord_pd(m, m);
+      m = _mm_or_pd(_mm_and_pd(unordered, v), _mm_andnot_pd(unordered, better));
+    }
+    double lanes[2];
+    _mm_storeu_pd(lanes, m);
+    for (int j = 0; j < 2; j++) {
+      if (beats(lanes[j], extreme, wantMax)) extreme = lanes[j];
+    }
+  }
+#endif
+  for (; i < count; i++) {
+    if (beats(x[i], extreme, wantMax)) extreme = x[i];
+  }
+  return extreme;
+}
+
+static void scaleKernel(double *x, double factor, double *out, int count) {
+  int i = 0;
+#if defined(__AVX__)
+  __m256d f = _mm256_set1_pd(factor);
+  for (; i + 4 <= count; i += 4) {
+    _mm256_storeu_pd(out + i, _mm256_mul_pd(_mm256_loadu_pd(x + i), f));
+  }
+#elif defined(__SSE2__)
+  __m128d f = _mm_set1_pd(factor);
+  for (; i + 2 <= count; i += 2) {
+    _mm_storeu_pd(out + i, _mm_mul_pd(_mm_loadu_pd(x + i), f));
+  }
+#endif
+  for (; i < count; i++) out[i] = x[i] * factor;
+}
+
+/* The array natives take arrays of nothing but numbers. Ones that got boxed along the way are
+   packed again, see packArrayObject(). */
+static NumberArray *numbersOf(Value value, VM *vm) {
+  if (!IS_ARRAY(value) || !packArrayObject(AS_ARRAY(value), vm)) return NULL;
+  return &AS_ARRAY(value)->numbers;
+}
+
+/* sum(array) adds up the numbers in an array. */
+Value sumNative(int argCount, Value *args, VM *vm) {
+  NumberArray *numbers = argCount == 1 ? numbersOf(args[0], vm) : NULL;
+  if (numbers == NULL) return NIL_VAL;
+  return NUMBER_VAL(sumKernel(numbers->values, numbers->count));
+}
+
+/* min(array) and max(array) give nil for an empty array. */
+Value minNative(int argCount, Value *args, VM *vm) {
+  NumberArray *numbers = argCount == 1 ? numbersOf(args[0], vm) : NULL;
+  if (numbers == NULL || numbers->count == 0) return NIL_VAL;
+  return NUMBER_VAL(extremeKernel(numbers->values, numbers->count, 0));
+}
+
+Value maxNative(int argCount, Value *args, VM *vm) {
+  NumberArray *numbers = argCount == 1 ? numbersOf(args[0], vm) : NULL;
+  if (numbers == NULL || numbers->count == 0) return NIL_VAL;
+  return NUMBER_VAL(extremeKernel(numbers->values, numbers->count, 1));
+}
+
+/* dot(a, b) needs the two arrays to be the same length. */
+Value dotNative(int argCount, Value *args, VM *vm) {
+  if (argCount != 2) return NIL_VAL;
+  NumberArray *a = numbersOf(args[0], vm);
+  NumberArray *b = numbersOf(args[1], vm);
+  if (a == NULL || b == NULL || a->count != b->count) return NIL_VAL;
+  return NUMBER_VAL(dotKernel(a->values, b->values, a->count));
+}
+
+/* scale(array, factor) hands back a new array, leaving the old one as it was. */
+Value scaleNative(int argCount, Value *args, VM *vm) {
+  NumberArray *numbers = argCount == 2 ? numbersOf(args[0], vm) : NULL;
+  if (numbers == NULL || !IS_NUMBER(args[1])) return NIL_VAL;
+  VMStack *stack = getStack(vm);
+  ObjArray *result = newArrayObject(vm);
+  push(stack, OBJECT_VAL(result));
+  if (numbers->count > 0) {
+    result->numbers.values = ALLOCATE(double, numbers->count, vm);
+    result->numbers.capacity = numbers->count;
+  }
+  scaleKernel(numbers->values, AS_NUMBER(args[1]), result->numbers.values, numbers->count);
+  result->numbers.count = numbers->count;
+  return pop(stack);
 }
 
 int loadLibrary(libraryStruct *pointer) {
-  pointer->library[0] = LIBFN("disp", RETURN_NIL, displayNative);
-  pointer->library[1] = LIBFN("pi", RETURN_NUM, piNative);
-  pointer->library[2] = LIBFN("input", RETURN_STRING, inputNative);
-  pointer->library[3] = LIBFN("clock", RETURN_NUM, clockNative);
+  pointer->library[0] = LIBFN_VALUE("disp", displayNative);
+  pointer->library[1] = LIBFN_VALUE("pi", piNative);
+  pointer->library[2] = LIBFN_VALUE("input", inputNative);
+  pointer->library[3] = LIBFN_VALUE("clock", clockNative);
+  pointer->library[4] = LIBFN_VALUE("gcstats", gcStatsNative);
+  pointer->library[5] = LIBFN_VALUE("weak", weakNative);
+  pointer->library[6] = LIBFN_VALUE("sum", sumNative);
+  pointer->library[7] = LIBFN_VALUE("min", minNative);
+  pointer->library[8] = LIBFN_VALUE("max", maxNative);
+  pointer->library[9] = LIBFN_VALUE("dot", dotNative);
+  pointer->library[10] = LIBFN_VALUE("scale", scaleNative);
   return 0;
 }
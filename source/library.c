@@ -21,6 +21,9 @@ static int librariesCount = 0;
 
 Value wrapLibraryFunc(libFn *libfn, int argCount, Value *args, VM *vm) {
   switch (libfn->rettype) {
+  case RETURN_VALUE: {
+    return ((NativeFn) libfn->function)(argCount, args, vm);
+  }
   case RETURN_NIL: {
     libfn->function(argCount, args);
     return NIL_VAL;
@@ -56,6 +59,14 @@ void loadNativeLibrary(char *filename, VM *vm) {
     exit(1);
   }
 
+  int *abiVersion = (int *) dlsym(library, "LibraryABIVersion");
+  int version = abiVersion == NULL ? 1 : *abiVersion;
+
+  if (version < 1 || version > LIBRARY_ABI_VERSION) {
+    fprintf(stderr, "Error in '%s' native library: unsupported library ABI version %d.\n", filename, version);
+    exit(1);
+  }
+
   libraryStruct *libPointer = malloc(sizeof(libraryStruct) + sizeof(libFn) * *libCount);
   
   if (libPointer == NULL) {
@@ -67,6 +78,10 @@ void loadNativeLibrary(char *filename, VM *vm) {
   
   if (!result) {
     for (int i = 0; i < *libCount; i++) {
+      if (version < 2 && libPointer->library[i].rettype == RETURN_VALUE) {
+	fprintf(stderr, "Error in '%s' native library: '%s' returns a Value, which needs library ABI version 2.\n", filename, libPointer->library[i].name);
+	exit(1);
+      }
       defineNative(libPointer->library[i].name, libPointer->library[i], vm);
     }
     if (DEBUG_PRINT_LIBRARY) {
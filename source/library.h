@@ -13,6 +13,10 @@
    You must define the following variable:
    int LibraryFunctionCount - This is what Joint uses to know how many functions to load.
 
+   You can also define:
+   int LibraryABIVersion - Which version of the library interface the library was written
+                           against. Libraries without it are treated as version 1.
+
    You must also define the following function
    int loadLibrary(libraryStruct *pointer) - This is the function that Joint looks for 
                                              when loading a library. 
@@ -25,6 +29,15 @@
    in the libraryStruct * that Joint provides, and return an exit code.
    An exit code of 0 is interpreted as no error, similar to standard Unix exit codes.
 
+   Version 1 functions have the LibraryFn signature and return a malloc'ed result (a double *
+   for RETURN_NUM, a char * for RETURN_STRING) that Joint copies and frees. Version 2 libraries
+   can also use RETURN_VALUE functions, added with LIBFN_VALUE. These have the NativeFn
+   signature: they get the VM, read their arguments straight off the VM stack and return a
+   Value, so nothing has to be allocated just to hand a result back. Strings can be built in
+   place by filling the buffer from reserveString() and passing it to takeString().
+   A Value-returning function must be built with the same Value representation as Joint, so
+   build the library and Joint with the same NAN_BOXING setting.
+
    Native Libraries are powerful because they provide direct access to C functions, which
    are just about always faster than anything that could be written directly in Trilox.
    However, they have a limited ability to interact with the rest of the Trilox system.
@@ -33,12 +46,16 @@
    provided by the library.
 */
 
+#define LIBRARY_ABI_VERSION 2
+
 #define LIBFN(name, type, func) ((libFn) {name, type, func})
+#define LIBFN_VALUE(name, func) ((libFn) {name, RETURN_VALUE, (LibraryFn) func})
 
 typedef enum {
   RETURN_NUM,
   RETURN_NIL,
   RETURN_STRING,
+  RETURN_VALUE, /* The function is really a NativeFn. Version 2 and up. */
 } returnType;
 
 typedef void *(*LibraryFn)(int argCount, Value *args);
@@ -4,6 +4,8 @@
 #include <unistd.h>
 #include <stddef.h>
 #include <stdlib.h>
+#include <limits.h>
+#include <stdint.h>
 
 #include "config.h"
 #include "common.h"
@@ -39,6 +41,7 @@ int runPrompt() {
   printf("Well, I sure would like to run a REPL, but I just don't know how. \nCan you help me learn? \n");
   VM vim;
   initVM(&vim);
+  vim.immortalCode = 0;
   while (1) {
     printf("%s ", REPL_PROMPT);
     char *line = NULL;
@@ -51,7 +54,10 @@ int runPrompt() {
     }
     printf("%s", line);
     hadError = interpret(line, "REPL", &vim);
-    if (hadError) initVM(&vim);
+    if (hadError) {
+      initVM(&vim);
+      vim.immortalCode = 0;
+    }
     free(line); 
   }
   freeVM(&vim);
@@ -97,12 +103,57 @@ static int runFile(char *filename) {
   }
 }
 
+/* Reads a number of bytes, optionally ending in K, M or G. Returns 0 if it isn't one. */
+static size_t parseBytes(char *text) {
+  char *end = NULL;
+  unsigned long long bytes = strtoull(text, &end, 10);
+  if (end == text || text[0] == '-') return 0;
+  int shift = 0;
+  switch (*end) {
+  case 'k': case 'K': shift = 10; end++; break;
+  case 'm': case 'M': shift = 20; end++; break;
+  case 'g': case 'G': shift = 30; end++; break;
+  }
+  if (*end != '\0' || bytes > (SIZE_MAX >> shift)) return 0;
+  return (size_t) bytes << shift;
+}
+
+/* Returns 0 if the text isn't a growth factor above 1. */
+static double parseGrowth(char *text) {
+  char *end = NULL;
+  double factor = strtod(text, &end);
+  if (end == text || *end != '\0' || !(factor > 1.0) || factor > 1024.0) return 0;
+  return factor;
+}
+
+/* The heap settings can come from the environment too, for when joint is started by something
+   else. Options on the command line win. */
+static void readEnvironment() {
+  char *value = getenv("JOINT_GC_INITIAL_HEAP");
+  if (value != NULL && (GC_INITIAL_HEAP = parseBytes(value)) == 0) {
+    fprintf(stderr, "JOINT_GC_INITIAL_HEAP must be a number of bytes, like 64M!\n");
+    exit(EX_USAGE);
+  }
+  value = getenv("JOINT_GC_GROWTH");
+  if (value != NULL && (GC_GROWTH_FACTOR = parseGrowth(value)) == 0) {
+    fprintf(stderr, "JOINT_GC_GROWTH must be a number greater than 1!\n");
+    exit(EX_USAGE);
+  }
+  value = getenv("JOINT_MAX_HEAP");
+  if (value != NULL && (GC_MAX_HEAP = parseBytes(value)) == 0) {
+    fprintf(stderr, "JOINT_MAX_HEAP must be a number of bytes, like 64M!\n");
+    exit(EX_USAGE);
+  }
+}
+
 int main(int argc, char **argv) {
   argc--, argv++;
 
   char *filename = "REPL";
 
-  char *helpstring = "Usage: \tjoint [FILE] [OPTIONS] ...\n\tjoint [OPTIONS] ...\n\nA hand-rolled Trilox interpreter, for when you really need that third option.\n\nOptions:\n -h, --help\t\tPrints this text.\n -f, --file [FILE]\tOpens the file specified.\n -p, --prompt [PROMPT]\tReplaces the REPL prompt with the prompt specified. Has no effect if running a script.\n --debug [OPTIONS]\tEnables the provided debug options.\n\nDebug Options:\n print-bytecode\t\tPrints the bytecode generated by the compiler before running it.\n log-gc\t\t\tLogs each of the actions taken by the garbage collector, both allocating and freeing memory.\n stress-gc\t\tStress tests the garbage collector by running it everytime memory is allocated.\n";
+  char *helpstring = "Usage: \tjoint [FILE] [OPTIONS] ...\n\tjoint [OPTIONS] ...\n\nA hand-rolled Trilox interpreter, for when you really need that third option.\n\nOptions:\n -h, --help\t\tPrints this text.\n -f, --file [FILE]\tOpens the file specified.\n -p, --prompt [PROMPT]\tReplaces the REPL prompt with the prompt specified. Has no effect if running a script.\n --gc-pause [MICROSECONDS]\tCollects garbage a slice at a time, pausing for about this long per slice,\n\t\t\tinstead of all at once.\n --gc-threads [THREADS]\tMarks the heap with this many threads during full collections.\n --gc-initial-heap [BYTES]\tHow big the heap gets before the first full collection. Takes K, M and G suffixes.\n --gc-growth [FACTOR]\tHow many times bigger the heap gets before the next full collection.\n --max-heap [BYTES]\tStops the script with a runtime error if its heap grows past this. Takes K, M and G suffixes.\n --gc-compact [FRACTION]\tMoves objects out of mostly empty pages and hands the pages back once more than\n\t\t\tthis fraction of the page memory is free after a full collection, like 0.5.\n --gc-stats\t\tPrints the garbage collector's stats as JSON to stderr on the way out.\n --debug [OPTIONS]\tEnables the provided debug options.\n\nDebug Options:\n print-bytecode\t\tPrints the bytecode generated by the compiler before running it.\n log-gc\t\t\tLogs each of the actions taken by the garbage collector, both allocating and freeing memory.\n stress-gc\t\tStress tests the garbage collector by running it everytime memory is allocated.\n\nEnvironment:\n JOINT_GC_INITIAL_HEAP, JOINT_GC_GROWTH, JOINT_MAX_HEAP\n\t\t\tDefaults for --gc-initial-heap, --gc-growth and --max-heap.\n";
+
+  readEnvironment();
   
   if (argc == 1) {
     if (strcmp(argv[0], "-h") == 0 || strcmp(argv[0], "--help") == 0) {
@@ -147,6 +198,59 @@ int main(int argc, char **argv) {
 	  }
 	  i++;
 	}
+      } else if (strcmp(argv[i], "--gc-pause") == 0) {
+	i++;
+	char *end = NULL;
+	long pause = i < argc ? strtol(argv[i], &end, 10) : 0;
+	if (!(i < argc) || *end != '\0' || pause <= 0 || pause > INT_MAX) {
+	  fprintf(stderr, "Must include a number of microseconds after '--gc-pause' argument!\n");
+	  fprintf(stderr, "\n%s", helpstring);
+	  exit(EX_USAGE);
+	}
+	GC_MAX_PAUSE = (int) pause;
+      } else if (strcmp(argv[i], "--gc-threads") == 0) {
+	i++;
+	char *end = NULL;
+	long threads = i < argc ? strtol(argv[i], &end, 10) : 0;
+	if (!(i < argc) || *end != '\0' || threads <= 0 || threads > GC_MAX_THREADS) {
+	  fprintf(stderr, "Must include a number of threads from 1 to %d after '--gc-threads' argument!\n", GC_MAX_THREADS);
+	  fprintf(stderr, "\n%s", helpstring);
+	  exit(EX_USAGE);
+	}
+	GC_THREADS = (int) threads;
+      } else if (strcmp(argv[i], "--gc-compact") == 0) {
+	i++;
+	char *end = NULL;
+	double fraction = i < argc ? strtod(argv[i], &end) : 0;
+	if (!(i < argc) || *end != '\0' || !(fraction > 0) || !(fraction < 1)) {
+	  fprintf(stderr, "Must include a fraction between 0 and 1 after '--gc-compact' argument!\n");
+	  fprintf(stderr, "\n%s", helpstring);
+	  exit(EX_USAGE);
+	}
+	GC_COMPACT_THRESHOLD = fraction;
+      } else if (strcmp(argv[i], "--gc-stats") == 0) {
+	GC_PRINT_STATS = 1;
+      } else if (strcmp(argv[i], "--gc-initial-heap") == 0) {
+	i++;
+	if (!(i < argc) || (GC_INITIAL_HEAP = parseBytes(argv[i])) == 0) {
+	  fprintf(stderr, "Must include a number of bytes after '--gc-initial-heap' argument!\n");
+	  fprintf(stderr, "\n%s", helpstring);
+	  exit(EX_USAGE);
+	}
+      } else if (strcmp(argv[i], "--gc-growth") == 0) {
+	i++;
+	if (!(i < argc) || (GC_GROWTH_FACTOR = parseGrowth(argv[i])) == 0) {
+	  fprintf(stderr, "Must include a number greater than 1 after '--gc-growth' argument!\n");
+	  fprintf(stderr, "\n%s", helpstring);
+	  exit(EX_USAGE);
+	}
+      } else if (strcmp(argv[i], "--max-heap") == 0) {
+	i++;
+	if (!(i < argc) || (GC_MAX_HEAP = parseBytes(argv[i])) == 0) {
+	  fprintf(stderr, "Must include a number of bytes after '--max-heap' argument!\n");
+	  fprintf(stderr, "\n%s", helpstring);
+	  exit(EX_USAGE);
+	}
       } else if (strcmp(argv[i], "-p") == 0 || strcmp(argv[i], "--prompt") == 0) {
 	i++;
 	if (!(i < argc) || argv[i][0] == '-') {
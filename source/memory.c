@@ -1,6 +1,15 @@
 #include <stdio.h>
 #include <stddef.h>
 #include <stdlib.h>
+#include <limits.h>
+#include <time.h>
+#include <inttypes.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
 
 #include "config.h"
 #include "memory.h"
@@ -10,16 +19,168 @@
 #include "value.h"
 #include "vm.h"
 
-void *reallocate(void *pointer, size_t oldSize, size_t newSize, VM *vm) {
-  vm->bytesAllocated += newSize - oldSize;
-  if (newSize > oldSize) {
-    if (DEBUG_STRESS_GC) {
+#ifdef __SANITIZE_ADDRESS__
+#include <sanitizer/asan_interface.h>
+/* Everything past the header and the free list link of a free cell is off limits. */
+#define POISON_CELL(cell, size) \
+  ASAN_POISON_MEMORY_REGION((char *)(cell) + sizeof(FreeCell), (size) - sizeof(FreeCell))
+#define UNPOISON_CELL(cell, size) \
+  ASAN_UNPOISON_MEMORY_REGION((char *)(cell) + sizeof(FreeCell), (size) - sizeof(FreeCell))
+#else
+#define POISON_CELL(cell, size) ((void)0)
+#define UNPOISON_CELL(cell, size) ((void)0)
+#endif
+
+/* The mark of a cell that doesn't hold an object. */
+#define FREE_CELL 0xff
+/* The mark of a cell whose object compaction has moved, see ForwardedCell. */
+#define FORWARDED_CELL 0xfe
+
+/* Object headers have no room for a link, so a free cell keeps its free list link right after
+   the header. Every object is at least this big anyway. */
+struct FreeCell {
+  Object obj;
+  FreeCell *next;
+};
+
+/* What's left of an object compaction has moved: a pointer to the new copy. */
+typedef struct {
+  Object obj;
+  Object *copy;
+} ForwardedCell;
+
+#define SIZE_CLASS(size) (((size) + GC_CELL_GRANULE - 1) / GC_CELL_GRANULE - 1)
+#define CLASS_SIZE(sizeClass) (((sizeClass) + 1) * GC_CELL_GRANULE)
+
+/* A page holds cells of one size class back to back. A page whose cells have all been freed just
+   keeps them on the free list for the next objects of that size, pages are only handed back to the
+   system when compactHeap() empties them. */
+struct Page {
+  Page *next;
+  int cellSize;
+  int cellCount;
+  char cells[];
+};
+
+#define PAGE_CELL(page, index) ((Object *)((page)->cells + (size_t)(index) * (page)->cellSize))
+
+/* A chunk of the immortal region, filled from the front. */
+struct Region {
+  Region *next;
+  size_t used;
+  size_t size;
+  char bytes[];
+};
+
+#define IMMORTAL_ALIGN(size) (((size) + sizeof(void *) - 1) & ~(sizeof(void *) - 1))
+
+static uint64_t nanosNow() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/* Records how long something took since 'start', a time from nanosNow(). */
+static void recordSince(GcHistogram *histogram, uint64_t start) {
+  uint64_t nanos = nanosNow() - start;
+  histogram->count++;
+  histogram->totalNanos += nanos;
+  if (nanos > histogram->maxNanos) histogram->maxNanos = nanos;
+  int bucket = 0;
+  for (uint64_t micros = nanos / 1000; micros > 0 && bucket < GC_HISTOGRAM_BUCKETS - 1; micros >>= 1) {
+    bucket++;
+  }
+  histogram->buckets[bucket]++;
+}
+
+static void startCycle(VM *vm);
+static void sweepSome(int work, VM *vm);
+static void collectStep(VM *vm);
+static void finishCycle(VM *vm);
+
+static void stressCollect(VM *vm) {
+  if (vm->gcPhase == GC_IDLE && vm->minorsSinceMajor >= GC_STRESS_MAJOR_INTERVAL) {
+    if (GC_MAX_PAUSE > 0) {
+      startCycle(vm);
+    } else {
       collectGarbage(vm);
     }
+  } else if (vm->gcPhase == GC_IDLE || vm->gcPhase == GC_SWEEPING) {
+    collectYoungGarbage(vm);
+  }
+  if (vm->gcPhase != GC_IDLE) collectStep(vm);
+}
 
-    if (vm->bytesAllocated > vm->nextGC && !DEBUG_STRESS_GC) {
+static void collectIfNeeded(size_t grown, VM *vm) {
+  vm->nurseryBytes += grown;
+  if (DEBUG_STRESS_GC) {
+    stressCollect(vm);
+    return;
+  }
+  
+  if (vm->gcPhase == GC_SWEEPING && GC_MAX_PAUSE == 0) {
+    sweepSome(GC_LAZY_SWEEP_WORK, vm);
+    if (vm->nurseryBytes > GC_NURSERY_SIZE) {
+      collectYoungGarbage(vm);
+    }
+  } else if (vm->gcPhase != GC_IDLE) {
+    vm->stepBytes += grown;
+    if (vm->bytesAllocated > vm->nextGC * GC_GROWTH_FACTOR) {
+      finishCycle(vm); /* The mutator is outrunning the slices. */
+    } else if (vm->stepBytes > GC_STEP_SIZE) {
+      collectStep(vm);
+    }
+    if (vm->gcPhase == GC_SWEEPING && vm->nurseryBytes > GC_NURSERY_SIZE) {
+      collectYoungGarbage(vm);
+    }
+  } else if (vm->bytesAllocated > vm->nextGC) {
+    if (GC_MAX_PAUSE > 0) {
+      startCycle(vm);
+    } else {
       collectGarbage(vm);
     }
+  } else if (vm->nurseryBytes > GC_NURSERY_SIZE) {
+    collectYoungGarbage(vm);
+  }
+}
+
+/* Where the next major collection kicks in, never past the heap limit. */
+static size_t nextThreshold(VM *vm) {
+  size_t next = (size_t)(vm->bytesAllocated * GC_GROWTH_FACTOR);
+  if (GC_MAX_HEAP > 0 && next > GC_MAX_HEAP) next = GC_MAX_HEAP;
+  return next;
+}
+
+/* Frees everything it can right now, sweep included, for when memory is about to run out. */
+static void collectEverything(VM *vm) {
+  collectGarbage(vm);
+  finishCycle(vm);
+}
+
+/* Runs once an allocation has been counted. Going over GC_MAX_HEAP gets a full collection to make
+   room. If that isn't enough the allocation goes ahead anyway, the code asking for it can't be
+   stopped halfway through, and run() raises a runtime error at its next loop or call instead. */
+static void checkHeapLimit(VM *vm) {
+  if (GC_MAX_HEAP == 0 || vm->heapLimitHit || vm->bytesAllocated <= GC_MAX_HEAP) return;
+  collectEverything(vm);
+  if (vm->bytesAllocated > GC_MAX_HEAP) vm->heapLimitHit = 1;
+}
+
+/* malloc() and friends, but a failure gets a full collection and a second try before giving up. */
+static void *reallocOrCollect(void *pointer, size_t newSize, VM *vm) {
+  void *result = realloc(pointer, newSize);
+  if (result == NULL) {
+    collectEverything(vm);
+    result = realloc(pointer, newSize);
+  }
+  return result;
+}
+
+void *reallocate(void *pointer, size_t oldSize, size_t newSize, VM *vm) {
+  vm->bytesAllocated += newSize - oldSize;
+  if (newSize > oldSize) {
+    collectIfNeeded(newSize - oldSize, vm);
+    checkHeapLimit(vm);
   }
 
   if (newSize == 0) {
@@ -27,7 +188,7 @@ void *reallocate(void *pointer, size_t oldSize, size_t newSize, VM *vm) {
     return NULL;
   }
   
-  void *result = realloc(pointer, newSize);
+  void *result = reallocOrCollect(pointer, newSize, vm);
 
   if (result == NULL) {
     fprintf(stderr, "Ran out of memory growing array. RIP\n");
@@ -37,101 +198,398 @@ void *reallocate(void *pointer, size_t oldSize, size_t newSize, VM *vm) {
   return result;
 }
 
-static void freeObject(Object *object, VM *vm) {
-  if (DEBUG_LOG_GC) {
-    char *typeTag = "pleh";
-    switch(object->type) {
-    case OBJ_NATIVE: typeTag = "ObjNative"; break;
-    case OBJ_STRING: typeTag = "ObjString"; break;
-    case OBJ_FUNCTION: typeTag = "ObjFunction"; break;
-    case OBJ_CLOSURE: typeTag = "ObjClosure"; break;
-    case OBJ_UPVALUE: typeTag = "ObjUpvalue"; break;
-    case OBJ_ARRAY: typeTag = "ObjArray"; break;
-    case OBJ_TABLE: typeTag = "ObjTable"; break;
+static void newPage(int sizeClass, VM *vm) {
+  Page *page = (Page *)reallocOrCollect(NULL, GC_PAGE_SIZE, vm);
+  if (page == NULL) {
+    fprintf(stderr, "Ran out of memory allocating a page. RIP\n");
+    exit(1);
+  }
+  page->cellSize = CLASS_SIZE(sizeClass);
+  page->cellCount = (GC_PAGE_SIZE - sizeof(Page)) / page->cellSize;
+  page->next = vm->pages;
+  vm->pages = page;
+  vm->pageCount++;
+
+  /* Backwards, so the cells get handed out in address order. */
+  for (int i = page->cellCount - 1; i >= 0; i--) {
+    FreeCell *cell = (FreeCell *)PAGE_CELL(page, i);
+    cell->obj.mark = FREE_CELL;
+    cell->next = vm->freeCells[sizeClass];
+    vm->freeCells[sizeClass] = cell;
+    POISON_CELL(cell, page->cellSize);
+  }
+}
+
+/* Memory for an object. Small objects get a cell from their size class's free list, which is
+   much cheaper than malloc and keeps objects of a size packed together, anything bigger than
+   GC_MAX_CELL_SIZE goes through reallocate(). Either way it's counted in bytesAllocated and can
+   set off a collection. */
+void *allocateCell(size_t size, VM *vm) {
+  if (size > GC_MAX_CELL_SIZE) return reallocate(NULL, 0, size, vm);
+  
+  vm->bytesAllocated += size;
+  collectIfNeeded(size, vm);
+  checkHeapLimit(vm);
+
+  int sizeClass = SIZE_CLASS(size);
+  if (vm->freeCells[sizeClass] == NULL) newPage(sizeClass, vm);
+  FreeCell *cell = vm->freeCells[sizeClass];
+  UNPOISON_CELL(cell, CLASS_SIZE(sizeClass));
+  vm->freeCells[sizeClass] = cell->next;
+  vm->cellBytes += CLASS_SIZE(sizeClass);
+  return cell;
+}
+
+/* 'size' has to be the size the object was allocated with. */
+void freeCell(void *cell, size_t size, VM *vm) {
+  if (size > GC_MAX_CELL_SIZE) {
+    reallocate(cell, size, 0, vm);
+    return;
+  }
+  
+  vm->bytesAllocated -= size;
+  int sizeClass = SIZE_CLASS(size);
+  vm->cellBytes -= CLASS_SIZE(sizeClass);
+  FreeCell *freed = (FreeCell *)cell;
+  freed->obj.mark = FREE_CELL;
+  freed->next = vm->freeCells[sizeClass];
+  vm->freeCells[sizeClass] = freed;
+  POISON_CELL(freed, CLASS_SIZE(sizeClass));
+}
+
+/* Grows one of the collector's own arrays of objects, which live outside the heap. */
+static void appendObject(Object *object, Object ***objects, int *count, int *capacity) {
+  if (*capacity < *count + 1) {
+    *capacity = GROW_CAPACITY(*capacity);
+    *objects = (Object **)realloc(*objects, sizeof(Object *) * *capacity);
+    if (*objects == NULL) {
+      fprintf(stderr, "Ran out of memory in the garbage collector? Now that's irony!\n");
+      exit(1);
     }
-    printf("%p free type %s\n", (void *)object, typeTag);
   }
+  (*objects)[(*count)++] = object;
+}
 
+void addYoungObject(Object *object, VM *vm) {
+  appendObject(object, &vm->youngObjects, &vm->youngCount, &vm->youngCapacity);
+}
+
+static void addImmortalRoot(Object *object, VM *vm) {
+  if (vm->immortalRootCapacity < vm->immortalRootCount + 1) {
+    vm->immortalRootCapacity = GROW_CAPACITY(vm->immortalRootCapacity);
+    vm->immortalRoots = (Object **)realloc(vm->immortalRoots, sizeof(Object *) * vm->immortalRootCapacity);
+    if (vm->immortalRoots == NULL) {
+      fprintf(stderr, "Ran out of memory in the garbage collector? Now that's irony!\n");
+      exit(1);
+    }
+  }
+  vm->immortalRoots[vm->immortalRootCount++] = object;
+}
+
+static Region *newRegion(size_t size, VM *vm) {
+  Region *region = (Region *)reallocOrCollect(NULL, sizeof(Region) + size, vm);
+  if (region == NULL) {
+    fprintf(stderr, "Ran out of memory growing the immortal region. RIP\n");
+    exit(1);
+  }
+  region->used = 0;
+  region->size = size;
+  vm->bytesAllocated += sizeof(Region) + size;
+  vm->stats.immortalBytes += sizeof(Region) + size;
+  checkHeapLimit(vm);
+  return region;
+}
+
+/* A new object that's never freed until the VM is, for the functions, constants and natives the
+   program is made of. They're cut one after the other from big chunks of memory, marked with
+   IMMORTAL_MARK so marking stops at them, and the sweep never sees them. Strings and natives
+   can't point at anything, but functions hold shapes in their inline caches and constant tables
+   and arrays get written to by the program, so those go in vm->immortalRoots, which every major
+   collection traces instead of the immortal region. Minor collections find them through the
+   remembered set like any other old object. */
+Object *allocateImmortal(size_t size, ObjType type, VM *vm) {
+  size_t rounded = IMMORTAL_ALIGN(size);
+  Region *region = vm->immortal;
+  if (rounded > GC_REGION_SIZE) {
+    /* Goes behind the chunk being filled, which still has room for smaller objects. */
+    Region *own = newRegion(rounded, vm);
+    own->next = region != NULL ? region->next : NULL;
+    if (region != NULL) {
+      region->next = own;
+    } else {
+      vm->immortal = own;
+    }
+    region = own;
+  } else if (region == NULL || region->used + rounded > region->size) {
+    region = newRegion(GC_REGION_SIZE, vm);
+    region->next = vm->immortal;
+    vm->immortal = region;
+  }
+
+  Object *object = (Object *)(region->bytes + region->used);
+  region->used += rounded;
+  object->type = type;
+  object->mark = IMMORTAL_MARK;
+  object->isRemembered = 0;
+  object->isLarge = 0;
+  object->pinCount = 0;
+  vm->stats.liveObjects[type]++;
+  vm->stats.liveBytes[type] += size;
+  if (type == OBJ_FUNCTION || type == OBJ_TABLE || type == OBJ_ARRAY) addImmortalRoot(object, vm);
+
+  if (DEBUG_LOG_GC) {
+    printf("%p allocate immortal %zu for %s\n", (void *)object, size, objectTypeName(type));
+  }
+  return object;
+}
+
+/* The size the object was allocated with, not counting the arrays it owns. */
+static size_t objectSize(Object *object) {
   switch (object->type) {
-  case OBJ_STRING: {
-    ObjString *string = (ObjString *)object;
-    FREE_ARRAY(char, string->chars, string->length + 1, vm);
-    FREE(ObjString, string, vm);
-    break;
+  case OBJ_NATIVE: return sizeof(ObjNative);
+  case OBJ_STRING: return FLEX_SIZE(ObjString, char, ((ObjString *)object)->length + 1);
+  case OBJ_FUNCTION: return sizeof(ObjFunction);
+  case OBJ_CLOSURE: return FLEX_SIZE(ObjClosure, ObjUpvalue *, ((ObjClosure *)object)->upvalueCount);
+  case OBJ_UPVALUE: return sizeof(ObjUpvalue);
+  case OBJ_ARRAY: return sizeof(ObjArray);
+  case OBJ_TABLE: return sizeof(ObjTable);
+  case OBJ_SHAPE: return sizeof(ObjShape);
+  case OBJ_ROPE:
+  default: return sizeof(ObjRope);
   }
+}
+
+/* Frees the arrays and tables an object owns, but not the object itself. */
+static void freeContents(Object *object, VM *vm) {
+  switch (object->type) {
+  case OBJ_STRING:
+  case OBJ_NATIVE:
+  case OBJ_ROPE:
+  case OBJ_CLOSURE:
+  case OBJ_UPVALUE: break;
   case OBJ_FUNCTION: {
     ObjFunction *function = (ObjFunction *)object;
     freeChunk(&function->chunk, vm);
-    FREE(ObjFunction, object, vm);
-  } break;
-  case OBJ_NATIVE: {
-    FREE(ObjNative, object, vm);
-  } break;
-  case OBJ_CLOSURE: {
-    ObjClosure *closure = (ObjClosure *)object;
-    FREE_ARRAY(ObjUpvalue *, closure->upvalues, closure->upvalueCount, vm);
-    FREE(ObjClosure, object, vm);
-  } break;
-  case OBJ_UPVALUE: {
-    FREE(ObjUpvalue, object, vm);
   } break;
   case OBJ_ARRAY: {
     ObjArray *array = (ObjArray *)object;
-    freeValueArray(&array->values, vm);
-    FREE(ObjArray, object, vm);
+    switch (array->storage) {
+    case ARRAY_PACKED: freeNumberArray(&array->numbers, vm); break;
+    case ARRAY_BOXED: freeValueArray(&array->values, vm); break;
+    case ARRAY_SPARSE: freeSparseArray(&array->sparse, vm); break;
+    }
   } break;
   case OBJ_TABLE: {
     ObjTable *table = (ObjTable *)object;
+    releaseTableSlots(table->slots, table->slotCapacity, vm);
+    releasePendingMethods(table, vm);
     freeTable(&table->table, vm);
-    FREE(ObjTable, object, vm);
+  } break;
+  case OBJ_SHAPE: {
+    ObjShape *shape = (ObjShape *)object;
+    if (shape->ownsLayout) {
+      FREE_ARRAY(ObjString *, shape->layout->keys, shape->layout->capacity, vm);
+      freeTable(&shape->layout->slots, vm);
+      FREE(ShapeLayout, shape->layout, vm);
+    }
+    freeTable(&shape->transitions, vm);
   } break;
   }
 }
 
-void freeObjects(Object *start, VM *vm) {
-  Object *object = start;
-  while (object != NULL){
-    Object *next = object->next;
-    freeObject(object, vm);
-    object = next;
+static void freeObject(Object *object, VM *vm) {
+  if (DEBUG_LOG_GC) {
+    printf("%p free type %s\n", (void *)object, objectTypeName(object->type));
   }
+  size_t size = objectSize(object);
+  vm->stats.liveObjects[object->type]--;
+  vm->stats.liveBytes[object->type] -= size;
+  freeContents(object, vm);
+  freeCell(object, size, vm);
 }
 
-void markObject(Object *object, VM *vm) {
-  if (object == NULL) return;
-  if (object->isMarked) return;
-  if (DEBUG_LOG_GC) {
-    printf("%p mark ", (void *)object);
-    printValue(OBJECT_VAL(object));
-    printf("\n");
+/* Calls 'visit' on every object in the immortal region. They're packed one after the other in
+   each chunk, so each one's size says where the next one starts. */
+static void visitImmortal(void (*visit)(Object *object, VM *vm), VM *vm) {
+  for (Region *region = vm->immortal; region != NULL; region = region->next) {
+    size_t offset = 0;
+    while (offset < region->used) {
+      Object *object = (Object *)(region->bytes + offset);
+      offset += IMMORTAL_ALIGN(objectSize(object));
+      visit(object, vm);
+    }
   }
-  object->isMarked = 1;
+}
 
-  if (vm->grayCapacity < vm->grayCount + 1) {
-    vm->grayCapacity = GROW_CAPACITY(vm->grayCapacity);
-    vm->grayStack = (Object **)realloc(vm->grayStack, sizeof(Object *) * vm->grayCapacity);
+int internedStringCount(VM *vm) {
+  int count = 0;
+  for (int i = 0; i < vm->strings.count; i++) {
+    if (vm->strings.entries[i].key != NULL) count++;
   }
+  return count;
+}
+
+static void printHistogram(char *name, GcHistogram *histogram, FILE *file) {
+  fprintf(file, "    \"%s\": {\"count\": %" PRIu64 ", \"totalMicros\": %.3f, \"maxMicros\": %.3f, \"buckets\": [",
+	  name, histogram->count, histogram->totalNanos / 1000.0, histogram->maxNanos / 1000.0);
+  for (int i = 0; i < GC_HISTOGRAM_BUCKETS; i++) {
+    fprintf(file, "%s%" PRIu64, i > 0 ? ", " : "", histogram->buckets[i]);
+  }
+  fprintf(file, "]}");
+}
+
+/* Everything in vm->stats as one JSON object. */
+void printGcStats(VM *vm, FILE *file) {
+  GcStats *stats = &vm->stats;
+  fprintf(file, "{\n");
+  fprintf(file, "  \"minorCollections\": %" PRIu64 ",\n", stats->minorCollections);
+  fprintf(file, "  \"majorCollections\": %" PRIu64 ",\n", stats->majorCollections);
+  fprintf(file, "  \"bytesAllocated\": %zu,\n", vm->bytesAllocated);
+  fprintf(file, "  \"bytesFreed\": %" PRIu64 ",\n", stats->bytesFreed);
+  fprintf(file, "  \"internedStrings\": %d,\n", internedStringCount(vm));
+  fprintf(file, "  \"immortalBytes\": %zu,\n", stats->immortalBytes);
+  fprintf(file, "  \"compactions\": %" PRIu64 ",\n", stats->compactions);
+  fprintf(file, "  \"pagesReleased\": %" PRIu64 ",\n", stats->pagesReleased);
+  fprintf(file, "  \"bucketLimitsMicros\": [");
+  for (int i = 0; i < GC_HISTOGRAM_BUCKETS - 1; i++) {
+    fprintf(file, "%s%" PRIu64, i > 0 ? ", " : "", (uint64_t) 1 << i);
+  }
+  fprintf(file, "],\n  \"pauses\": {\n");
+  printHistogram("minor", &stats->minorPauses, file);
+  fprintf(file, ",\n");
+  printHistogram("major", &stats->majorPauses, file);
+  fprintf(file, "\n  },\n  \"phases\": {\n");
+  printHistogram("mark", &stats->markTime, file);
+  fprintf(file, ",\n");
+  printHistogram("sweep", &stats->sweepTime, file);
+  fprintf(file, ",\n");
+  printHistogram("purge", &stats->purgeTime, file);
+  fprintf(file, ",\n");
+  printHistogram("compact", &stats->compactTime, file);
+  fprintf(file, "\n  },\n  \"live\": {\n");
+  for (int type = 0; type < OBJ_TYPE_COUNT; type++) {
+    fprintf(file, "    \"%s\": {\"objects\": %zu, \"bytes\": %zu}%s\n", objectTypeName(type),
+	    stats->liveObjects[type], stats->liveBytes[type], type < OBJ_TYPE_COUNT - 1 ? "," : "");
+  }
+  fprintf(file, "  }\n}\n");
+}
+
+static void freeImmortal(Object *object, VM *vm) {
+  vm->stats.liveObjects[object->type]--;
+  vm->stats.liveBytes[object->type] -= objectSize(object);
+  freeContents(object, vm);
+}
+
+void freeObjects(VM *vm) {
+  visitImmortal(freeImmortal, vm);
+  vm->immortalRootCount = 0;
+  while (vm->immortal != NULL) {
+    Region *next = vm->immortal->next;
+    vm->bytesAllocated -= sizeof(Region) + vm->immortal->size;
+    free(vm->immortal);
+    vm->immortal = next;
+  }
+  
+  for (int i = 0; i < vm->youngCount; i++) {
+    freeObject(vm->youngObjects[i], vm);
+  }
+  for (int i = 0; i < vm->largeCount; i++) {
+    freeObject(vm->largeObjects[i], vm);
+  }
+  vm->youngCount = 0;
+  vm->largeCount = 0;
+
+  /* What's left in the pages is the old small objects. */
+  Page *page = vm->pages;
+  while (page != NULL) {
+    for (int i = 0; i < page->cellCount; i++) {
+      Object *object = PAGE_CELL(page, i);
+      if (object->mark != FREE_CELL) freeObject(object, vm);
+    }
+    Page *next = page->next;
+    free(page);
+    page = next;
+  }
+  vm->pages = NULL;
+  vm->pageCount = 0;
+  vm->cellBytes = 0;
+  for (int i = 0; i < GC_SIZE_CLASSES; i++) {
+    vm->freeCells[i] = NULL;
+  }
+}
 
-  if (vm->grayStack == NULL) {
+static void pushGray(Object *object, GrayStack *gray) {
+  if (gray->capacity < gray->count + 1) {
+    gray->capacity = GROW_CAPACITY(gray->capacity);
+    gray->objects = (Object **)realloc(gray->objects, sizeof(Object *) * gray->capacity);
+  }
+
+  if (gray->objects == NULL) {
     fprintf(stderr, "Ran out of memory in the garbage collector? Now that's irony!\n");
     exit(1);
   }
   
-  vm->grayStack[vm->grayCount++] = object;
+  gray->objects[gray->count++] = object;
 }
 
-void markValue(Value value, VM *vm) {
-  if (IS_OBJECT(value)) markObject(AS_OBJECT(value), vm);
+static void grayObject(Object *object, GrayStack *gray, VM *vm) {
+  if (object == NULL) return;
+  if (gray->atomic) {
+    uint8_t mark = __atomic_load_n(&object->mark, __ATOMIC_RELAXED);
+    if (mark == vm->markColor || mark == IMMORTAL_MARK) return;
+    if (__atomic_exchange_n(&object->mark, vm->markColor, __ATOMIC_RELAXED) == vm->markColor) {
+      return; /* Some other thread got it first. */
+    }
+  } else {
+    if (IS_MARKED(object, vm)) return;
+    if (DEBUG_LOG_GC) {
+      printf("%p mark ", (void *)object);
+      printValue(OBJECT_VAL(object));
+      printf("\n");
+    }
+    object->mark = vm->markColor;
+  }
+  pushGray(object, gray);
 }
 
-static void markArray(ValueArray *array, VM *vm) {
+static void grayValue(Value value, GrayStack *gray, VM *vm) {
+  if (IS_OBJECT(value)) grayObject(AS_OBJECT(value), gray, vm);
+}
+
+static void grayArray(ValueArray *array, GrayStack *gray, VM *vm) {
   for (int i = 0; i < array->count; i++) {
-    markValue(array->values[i], vm);
+    grayValue(array->values[i], gray, vm);
   }
 }
 
-static void blackenObject(Object *object, VM *vm) {
-  if (DEBUG_LOG_GC) {
+static void grayTable(Table *table, GrayStack *gray, VM *vm) {
+  for (int i = 0; i < table->count; i++) {
+    Entry *entry = &table->entries[i];
+    grayObject((Object *)entry->key, gray, vm);
+    grayValue(entry->value, gray, vm);
+  }
+}
+
+void markObject(Object *object, VM *vm) {
+  grayObject(object, &vm->gray, vm);
+}
+
+void markValue(Value value, VM *vm) {
+  grayValue(value, &vm->gray, vm);
+}
+
+static void markArray(ValueArray *array, VM *vm) {
+  grayArray(array, &vm->gray, vm);
+}
+
+void markTable(Table *table, VM *vm) {
+  grayTable(table, &vm->gray, vm);
+}
+
+/* Only reads the object, so several threads can blacken at once as long as each has its own
+   gray stack. */
+static void blackenObject(Object *object, GrayStack *gray, VM *vm) {
+  if (DEBUG_LOG_GC && !gray->atomic) {
     printf("%p blacken ", (void *)object);
     printValue(OBJECT_VAL(object));
     printf("\n");
@@ -142,34 +600,130 @@ static void blackenObject(Object *object, VM *vm) {
   case OBJ_STRING: break;
   case OBJ_FUNCTION: {
     ObjFunction *function = (ObjFunction *)object;
-    markObject((Object *)function->name, vm);
-    markArray(&function->chunk.constants, vm);
+    grayObject((Object *)function->name, gray, vm);
+    grayArray(&function->chunk.constants, gray, vm);
+    for (int i = 0; i < function->chunk.jumpTables.count; i++) {
+      JumpTable *table = &function->chunk.jumpTables.tables[i];
+      for (int j = 0; j < table->caseCount; j++) {
+	grayValue(table->cases[j].key, gray, vm);
+      }
+    }
+    for (int i = 0; i < function->chunk.cacheCount; i++) {
+      InlineCache *cache = &function->chunk.caches[i];
+      for (int j = 0; j < INLINE_CACHE_WAYS; j++) {
+	grayObject((Object *)cache->entries[j].shape, gray, vm);
+	grayObject((Object *)cache->entries[j].transition, gray, vm);
+      }
+    }
   } break;
   case OBJ_CLOSURE: {
     ObjClosure *closure = (ObjClosure *)object;
-    markObject((Object *)closure->function, vm);
+    grayObject((Object *)closure->function, gray, vm);
     for (int i = 0; i < closure->upvalueCount; i++) {
-      markObject((Object *)closure->upvalues[i], vm);
+      grayObject((Object *)closure->upvalues[i], gray, vm);
     }
   } break;
   case OBJ_UPVALUE: {
-    markValue(((ObjUpvalue *)object)->closed, vm);
+    grayValue(((ObjUpvalue *)object)->closed, gray, vm);
+  } break;
+  case OBJ_ROPE: {
+    ObjRope *rope = (ObjRope *)object;
+    grayObject(rope->left, gray, vm);
+    grayObject(rope->right, gray, vm);
+    grayObject((Object *)rope->flat, gray, vm);
   } break;
   case OBJ_ARRAY: {
-    markArray(&((ObjArray *)object)->values, vm);
+    ObjArray *array = (ObjArray *)object;
+    if (array->storage == ARRAY_BOXED) {
+      grayArray(&array->values, gray, vm);
+    } else if (array->storage == ARRAY_SPARSE) {
+      for (int i = 0; i < array->sparse.capacity; i++) {
+	if (array->sparse.entries[i].index != 0) grayValue(array->sparse.entries[i].value, gray, vm);
+      }
+    }
   } break;
   case OBJ_TABLE: {
-    markTable(&((ObjTable *)object)->table, vm);
+    ObjTable *table = (ObjTable *)object;
+    if (table->shape != NULL) {
+      grayObject((Object *)table->shape, gray, vm);
+      for (int i = 0; i < table->shape->slotCount; i++) {
+	grayValue(table->slots->values[i], gray, vm);
+      }
+    }
+    if (table->pending != NULL) {
+      for (int i = 0; i < table->pending->count; i++) {
+	grayObject((Object *)table->pending->upvalues[i], gray, vm);
+      }
+    }
+    grayObject((Object *)table->self, gray, vm);
+    if (table->weak == 0) {
+      grayTable(&table->table, gray, vm);
+    } else {
+      /* The values it holds weakly are left for pruneWeakTables(). */
+      for (int i = 0; i < table->table.count; i++) {
+	Entry *entry = &table->table.entries[i];
+	if (entry->key == NULL) continue;
+	grayObject((Object *)entry->key, gray, vm);
+	if (!HOLDS_WEAKLY(entry->value)) grayValue(entry->value, gray, vm);
+      }
+    }
+  } break;
+  case OBJ_SHAPE: {
+    /* Transitions aren't marked here, see shapeRemoveWhite(). The layout's keys are marked by
+       the shape that owns it, which is always alive if a borrower is. */
+    ObjShape *shape = (ObjShape *)object;
+    grayObject((Object *)shape->parent, gray, vm);
+    grayObject((Object *)shape->key, gray, vm);
+    if (shape->ownsLayout) {
+      for (int i = 0; i < shape->layout->count; i++) {
+	grayObject((Object *)shape->layout->keys[i], gray, vm);
+      }
+    }
   } break;
   }
 }
 
-void markTable(Table *table, VM *vm) {
-  for (int i = 0; i < table->capacity; i++) {
-    Entry *entry = &table->entries[i];
-    markObject((Object *)entry->key, vm);
-    markValue(entry->value, vm);
+/* While an incremental collection is marking, the barrier turns a written black object gray
+   again instead, so a black object can never end up pointing at a white one. Old objects the
+   marking hasn't reached yet get traced with whatever they hold by then. */
+void rememberObject(Object *object, VM *vm) {
+  if (vm->gcPhase == GC_MARKING) {
+    if (!IS_MARKED(object, vm)) return;
+    object->isRemembered = 1;
+    pushGray(object, &vm->gray);
+    return;
   }
+  
+  if (vm->rememberedCapacity < vm->rememberedCount + 1) {
+    vm->rememberedCapacity = GROW_CAPACITY(vm->rememberedCapacity);
+    vm->remembered = (Object **)realloc(vm->remembered, sizeof(Object *) * vm->rememberedCapacity);
+    if (vm->remembered == NULL) {
+      fprintf(stderr, "Ran out of memory in the garbage collector? Now that's irony!\n");
+      exit(1);
+    }
+  }
+  object->isRemembered = 1;
+  vm->remembered[vm->rememberedCount++] = object;
+}
+
+/* Makes a young object old on the spot, for references that are stored somewhere without a
+   write barrier. It's remembered, so what it points to still gets traced by the next minor
+   collection, and it moves over to the old list then. */
+void tenureObject(Object *object, VM *vm) {
+  if (object == NULL || object->mark != 0) return;
+  if (vm->gcPhase == GC_MARKING) {
+    markObject(object, vm); /* Just make sure the collection in progress sees it. */
+    return;
+  }
+  object->mark = vm->markColor;
+  rememberObject(object, vm);
+}
+
+static void forgetRemembered(VM *vm) {
+  for (int i = 0; i < vm->rememberedCount; i++) {
+    vm->remembered[i]->isRemembered = 0;
+  }
+  vm->rememberedCount = 0;
 }
 
 static void markRoots(VM *vm) {
@@ -185,53 +739,757 @@ static void markRoots(VM *vm) {
   }
   
   markTable(&vm->globals, vm);
+  markArray(&vm->globalValues, vm);
+  markObject((Object *)vm->rootShape, vm);
   markCompilerRoots();
 }
 
+/* Only major collections need these, the rest of the time they're in the remembered set as soon
+   as they point at anything young. */
+static void markImmortalRoots(VM *vm) {
+  for (int i = 0; i < vm->immortalRootCount; i++) {
+    blackenObject(vm->immortalRoots[i], &vm->gray, vm);
+  }
+}
+
+/* Blackens up to 'work' gray objects, returns whether the gray stack ran dry. */
+static int traceSome(int work, VM *vm) {
+  while (vm->gray.count > 0 && work-- > 0) {
+    Object *object = vm->gray.objects[--vm->gray.count];
+    object->isRemembered = 0; /* See rememberObject(), a later write has to gray it again. */
+    blackenObject(object, &vm->gray, vm);
+  }
+  return vm->gray.count == 0;
+}
+
 static void traceReferences(VM *vm) {
-  while (vm->grayCount > 0) {
-    Object *object = vm->grayStack[--vm->grayCount];
-    blackenObject(object, vm);
+  traceSome(INT_MAX, vm);
+}
+
+/* Parallel marking. Each marker blackens from its own private stack, and every so often moves half
+   of it onto a shared stack that idle markers steal from. Marks are claimed atomically, so an object
+   reachable from two markers is still only blackened once, and the set of marked objects (which is
+   all the sweep looks at) comes out the same as marking on one thread. */
+typedef struct ParallelMark ParallelMark;
+
+typedef struct {
+  GrayStack local;
+  GrayStack shared;
+  int sharedCount; /* shared.count, readable without taking the lock. */
+  pthread_mutex_t lock;
+  pthread_t thread;
+  ParallelMark *mark;
+} Marker;
+
+struct ParallelMark {
+  int count;
+  int active; /* Markers that may still share work. Marking is done once it drops to 0. */
+  Marker *markers;
+  VM *vm;
+};
+
+static void moveGray(GrayStack *from, GrayStack *to, int count) {
+  for (int i = 0; i < count; i++) {
+    pushGray(from->objects[--from->count], to);
+  }
+}
+
+static void shareWork(Marker *self) {
+  pthread_mutex_lock(&self->lock);
+  if (self->shared.count == 0) {
+    moveGray(&self->local, &self->shared, self->local.count / 2);
+    __atomic_store_n(&self->sharedCount, self->shared.count, __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&self->lock);
+}
+
+static int stealWork(Marker *self) {
+  ParallelMark *mark = self->mark;
+  int start = self - mark->markers;
+  for (int i = 0; i < mark->count; i++) {
+    Marker *victim = &mark->markers[(start + i) % mark->count];
+    if (__atomic_load_n(&victim->sharedCount, __ATOMIC_ACQUIRE) == 0) continue;
+    pthread_mutex_lock(&victim->lock);
+    moveGray(&victim->shared, &self->local, (victim->shared.count + 1) / 2);
+    __atomic_store_n(&victim->sharedCount, victim->shared.count, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&victim->lock);
+    if (self->local.count > 0) return 1;
   }
+  return 0;
 }
 
-static void sweep(VM *vm) {
-  Object *previous = NULL;
-  Object *object = vm->objects;
-  while (object != NULL) {
-    if (object->isMarked) {
-      object->isMarked = 0;
-      previous = object;
-      object = object->next;
+static void *runMarker(void *argument) {
+  Marker *self = (Marker *)argument;
+  ParallelMark *mark = self->mark;
+  for (;;) {
+    while (self->local.count > 0) {
+      blackenObject(self->local.objects[--self->local.count], &self->local, mark->vm);
+      if (self->local.count > GC_SHARE_THRESHOLD && __atomic_load_n(&self->sharedCount, __ATOMIC_ACQUIRE) == 0) {
+	shareWork(self);
+      }
+    }
+    if (stealWork(self)) continue;
+
+    /* Out of work. Only markers that still have some can share more, so once nobody's active the
+       shared stacks are empty for good. */
+    __atomic_sub_fetch(&mark->active, 1, __ATOMIC_ACQ_REL);
+    for (;;) {
+      if (__atomic_load_n(&mark->active, __ATOMIC_ACQUIRE) == 0) return NULL;
+      __atomic_add_fetch(&mark->active, 1, __ATOMIC_ACQ_REL);
+      if (stealWork(self)) break;
+      __atomic_sub_fetch(&mark->active, 1, __ATOMIC_ACQ_REL);
+      sched_yield();
+    }
+  }
+}
+
+static int shouldMarkInParallel(VM *vm) {
+  if (GC_THREADS <= 1 || DEBUG_LOG_GC) return 0;
+  return DEBUG_STRESS_GC || vm->bytesAllocated >= GC_PARALLEL_MIN_BYTES;
+}
+
+/* Traces everything gray on the VM's stack across GC_THREADS threads, this one included. */
+static void traceReferencesParallel(VM *vm) {
+  ParallelMark mark;
+  Marker markers[GC_MAX_THREADS];
+  mark.count = GC_THREADS;
+  mark.active = GC_THREADS;
+  mark.markers = markers;
+  mark.vm = vm;
+  
+  for (int i = 0; i < mark.count; i++) {
+    markers[i].local = (GrayStack){0, 0, NULL, 1};
+    markers[i].shared = (GrayStack){0, 0, NULL, 1};
+    markers[i].sharedCount = 0;
+    markers[i].mark = &mark;
+    pthread_mutex_init(&markers[i].lock, NULL);
+  }
+  for (int i = 0; vm->gray.count > 0; i++) {
+    moveGray(&vm->gray, &markers[i % mark.count].local, 1);
+  }
+
+  int started = 1;
+  for (; started < mark.count; started++) {
+    if (pthread_create(&markers[started].thread, NULL, runMarker, &markers[started]) != 0) break;
+  }
+  if (started < mark.count) {
+    /* Couldn't get all the threads. The ones that never started are counted as active and hold work,
+       so hand their work to this thread and stop counting them. */
+    for (int i = started; i < mark.count; i++) {
+      pthread_mutex_lock(&markers[i].lock);
+      moveGray(&markers[i].local, &markers[0].local, markers[i].local.count);
+      pthread_mutex_unlock(&markers[i].lock);
+      __atomic_sub_fetch(&mark.active, 1, __ATOMIC_ACQ_REL);
+    }
+  }
+  
+  runMarker(&markers[0]);
+  for (int i = 1; i < started; i++) {
+    pthread_join(markers[i].thread, NULL);
+  }
+  
+  for (int i = 0; i < mark.count; i++) {
+    pthread_mutex_destroy(&markers[i].lock);
+    free(markers[i].local.objects);
+    free(markers[i].shared.objects);
+  }
+}
+
+/* Frees every unmarked young object. What's left stays marked, which makes it old. */
+static void sweepYoungObjects(VM *vm) {
+  int kept = 0;
+  for (int i = 0; i < vm->youngCount; i++) {
+    Object *object = vm->youngObjects[i];
+    if (object->mark == vm->markColor) {
+      vm->youngObjects[kept++] = object;
     } else {
-      Object *unreached = object;
-      object = object->next;
-      if (previous != NULL) {
-	previous->next = object;
+      freeObject(object, vm);
+    }
+  }
+  vm->youngCount = kept;
+}
+
+/* Empties the young objects, all of them have survived. The large ones join the old large
+   objects, small ones don't need tracking once they're old, the sweep finds them in the pages. */
+static void promoteYoung(VM *vm) {
+  for (int i = 0; i < vm->youngCount; i++) {
+    Object *object = vm->youngObjects[i];
+    if (object->isLarge) {
+      appendObject(object, &vm->largeObjects, &vm->largeCount, &vm->largeCapacity);
+    }
+  }
+  vm->youngCount = 0;
+}
+
+/* Every old object is left with the current color, so switching colors unmarks them all. */
+static void flipMarkColor(VM *vm) {
+  vm->markColor = vm->markColor == 1 ? 2 : 1;
+}
+
+void registerWeakTable(ObjTable *table, VM *vm) {
+  if (vm->weakTableCapacity < vm->weakTableCount + 1) {
+    vm->weakTableCapacity = GROW_CAPACITY(vm->weakTableCapacity);
+    vm->weakTables = (ObjTable **)realloc(vm->weakTables, sizeof(ObjTable *) * vm->weakTableCapacity);
+    if (vm->weakTables == NULL) {
+      fprintf(stderr, "Ran out of memory in the garbage collector? Now that's irony!\n");
+      exit(1);
+    }
+  }
+  vm->weakTables[vm->weakTableCount++] = table;
+}
+
+/* Weak tables that weren't marked are about to be swept, so they're dropped from the list
+   instead. A minor collection only ever finds young keys and values dead, and an old table can
+   only have picked those up if it's been remembered since the last one, so it leaves the rest
+   alone. Young weak tables are pruned along with the other young objects, see
+   removeYoungWhiteReferences(). */
+static void pruneWeakTables(int minor, VM *vm) {
+  int kept = 0;
+  for (int i = 0; i < vm->weakTableCount; i++) {
+    ObjTable *table = vm->weakTables[i];
+    if (!IS_MARKED(&table->obj, vm)) continue;
+    if (!minor || table->obj.isRemembered) tableRemoveWeak(&table->table, vm);
+    vm->weakTables[kept++] = table;
+  }
+  vm->weakTableCount = kept;
+}
+
+static void removeWhiteReferences(VM *vm) {
+  uint64_t start = nanosNow();
+  tableRemoveWhite(&vm->strings, vm);
+  pruneWeakTables(0, vm);
+  if (vm->rootShape != NULL) shapeRemoveWhite(vm->rootShape, vm);
+  recordSince(&vm->stats.purgeTime, start);
+}
+
+/* The same for a minor collection, which can only find young objects dead. Going through those
+   keeps its pause down to the size of the nursery, where the intern table and the shape tree
+   grow with the old heap. */
+static void removeYoungWhiteReferences(VM *vm) {
+  uint64_t start = nanosNow();
+  for (int i = 0; i < vm->youngCount; i++) {
+    Object *object = vm->youngObjects[i];
+    if (IS_MARKED(object, vm)) {
+      ObjTable *table = (ObjTable *)object;
+      if (object->type == OBJ_TABLE && table->weak != 0) tableRemoveWeak(&table->table, vm);
+    } else if (object->type == OBJ_STRING) {
+      tableDelete(&vm->strings, (ObjString *)object);
+    } else if (object->type == OBJ_SHAPE) {
+      shapeRemoveDead((ObjShape *)object, vm);
+    }
+  }
+  pruneWeakTables(1, vm);
+  recordSince(&vm->stats.purgeTime, start);
+}
+
+/* Sweeps the young objects once marking is done, the survivors are all marked. */
+static void sweepYoung(VM *vm) {
+  uint64_t start = nanosNow();
+  size_t before = vm->bytesAllocated;
+  sweepYoungObjects(vm);
+  vm->stats.bytesFreed += before - vm->bytesAllocated;
+  recordSince(&vm->stats.sweepTime, start);
+}
+
+/* Compaction. A page only ever holds objects of its own size class, so once lots of objects of
+   some size have died, their pages stay around mostly empty. When a full collection leaves more
+   than GC_COMPACT_THRESHOLD of the page memory free, the objects in the emptiest pages of each
+   size class get moved into the free cells of the fullest ones, every reference to them is
+   pointed at the new copy, and the emptied pages are handed back.
+
+   Objects only move at the safepoints in run(), where nothing but the VM's own structures holds
+   on to them. Large and immortal objects never move, and neither does anything in a page that
+   holds a pinned object. */
+typedef struct {
+  Page *page;
+  int live;
+  int pinned;
+} PageUsage;
+
+static double pageFragmentation(VM *vm) {
+  if (vm->pageCount == 0) return 0;
+  return 1.0 - (double) vm->cellBytes / ((double) vm->pageCount * GC_PAGE_SIZE);
+}
+
+/* Size classes together, and in each one the pinned pages and then the fullest come first. */
+static int compareUsage(const void *a, const void *b) {
+  const PageUsage *left = (const PageUsage *)a;
+  const PageUsage *right = (const PageUsage *)b;
+  if (left->page->cellSize != right->page->cellSize) return left->page->cellSize - right->page->cellSize;
+  if (left->pinned != right->pinned) return right->pinned - left->pinned;
+  return right->live - left->live;
+}
+
+static void measurePage(PageUsage *usage) {
+  Page *page = usage->page;
+  usage->live = 0;
+  usage->pinned = 0;
+  for (int i = 0; i < page->cellCount; i++) {
+    Object *object = PAGE_CELL(page, i);
+    if (object->mark == FREE_CELL) continue;
+    usage->live++;
+    if (object->pinCount > 0) usage->pinned = 1;
+  }
+}
+
+static void moveObject(Object *object, int sizeClass, VM *vm) {
+  Object *copy = (Object *)vm->freeCells[sizeClass];
+  vm->freeCells[sizeClass] = vm->freeCells[sizeClass]->next;
+  UNPOISON_CELL(copy, CLASS_SIZE(sizeClass));
+  memcpy(copy, object, CLASS_SIZE(sizeClass));
+  if (object->type == OBJ_UPVALUE) {
+    ObjUpvalue *upvalue = (ObjUpvalue *)object;
+    if (upvalue->location == &upvalue->closed) {
+      ((ObjUpvalue *)copy)->location = &((ObjUpvalue *)copy)->closed;
+    }
+  }
+  object->mark = FORWARDED_CELL;
+  ((ForwardedCell *)object)->copy = copy;
+}
+
+static Object *forward(Object *object) {
+  if (object != NULL && object->mark == FORWARDED_CELL) return ((ForwardedCell *)object)->copy;
+  return object;
+}
+
+#define FORWARD(pointer) ((pointer) = (void *)forward((Object *)(pointer)))
+
+static void forwardValue(Value *value) {
+  if (IS_OBJECT(*value)) *value = OBJECT_VAL(forward(AS_OBJECT(*value)));
+}
+
+static void forwardArray(ValueArray *array) {
+  for (int i = 0; i < array->count; i++) {
+    forwardValue(&array->values[i]);
+  }
+}
+
+static void forwardTable(Table *table) {
+  for (int i = 0; i < table->count; i++) {
+    Entry *entry = &table->entries[i];
+    FORWARD(entry->key);
+    forwardValue(&entry->value);
+  }
+}
+
+/* Everything blackenObject() follows, plus the layout's owner. An upvalue's next is only looked
+   at while it's open, see forwardReferences(). Takes the VM so it can be handed to visitImmortal(). */
+static void forwardFields(Object *object, VM *vm) {
+  switch (object->type) {
+  case OBJ_NATIVE:
+  case OBJ_STRING: break;
+  case OBJ_FUNCTION: {
+    ObjFunction *function = (ObjFunction *)object;
+    FORWARD(function->name);
+    forwardArray(&function->chunk.constants);
+    for (int i = 0; i < function->chunk.jumpTables.count; i++) {
+      JumpTable *table = &function->chunk.jumpTables.tables[i];
+      for (int j = 0; j < table->caseCount; j++) {
+	forwardValue(&table->cases[j].key);
+      }
+    }
+    for (int i = 0; i < function->chunk.cacheCount; i++) {
+      InlineCache *cache = &function->chunk.caches[i];
+      for (int j = 0; j < INLINE_CACHE_WAYS; j++) {
+	FORWARD(cache->entries[j].shape);
+	FORWARD(cache->entries[j].transition);
+      }
+    }
+  } break;
+  case OBJ_CLOSURE: {
+    ObjClosure *closure = (ObjClosure *)object;
+    FORWARD(closure->function);
+    for (int i = 0; i < closure->upvalueCount; i++) {
+      FORWARD(closure->upvalues[i]);
+    }
+  } break;
+  case OBJ_UPVALUE: {
+    forwardValue(&((ObjUpvalue *)object)->closed);
+  } break;
+  case OBJ_ROPE: {
+    ObjRope *rope = (ObjRope *)object;
+    FORWARD(rope->left);
+    FORWARD(rope->right);
+    FORWARD(rope->flat);
+  } break;
+  case OBJ_ARRAY: {
+    ObjArray *array = (ObjArray *)object;
+    if (array->storage == ARRAY_BOXED) {
+      forwardArray(&array->values);
+    } else if (array->storage == ARRAY_SPARSE) {
+      for (int i = 0; i < array->sparse.capacity; i++) {
+	if (array->sparse.entries[i].index != 0) forwardValue(&array->sparse.entries[i].value);
+      }
+    }
+  } break;
+  case OBJ_TABLE: {
+    ObjTable *table = (ObjTable *)object;
+    FORWARD(table->shape);
+    if (table->shape != NULL) {
+      for (int i = 0; i < table->shape->slotCount; i++) {
+	forwardValue(&table->slots->values[i]);
+      }
+    }
+    if (table->pending != NULL) {
+      for (int i = 0; i < table->pending->count; i++) {
+	FORWARD(table->pending->upvalues[i]);
+      }
+    }
+    FORWARD(table->self);
+    forwardTable(&table->table);
+  } break;
+  case OBJ_SHAPE: {
+    ObjShape *shape = (ObjShape *)object;
+    FORWARD(shape->parent);
+    FORWARD(shape->key);
+    if (shape->ownsLayout) {
+      shape->layout->owner = shape;
+      for (int i = 0; i < shape->layout->count; i++) {
+	FORWARD(shape->layout->keys[i]);
+      }
+      forwardTable(&shape->layout->slots);
+    }
+    forwardTable(&shape->transitions);
+  } break;
+  }
+}
+
+static void forwardReferences(VM *vm) {
+  for (Value *slot = vm->main_stack->stack; slot < vm->main_stack->top; slot++) {
+    forwardValue(slot);
+  }
+  for (int i = 0; i < vm->call_stack->frameCount; i++) {
+    FORWARD(vm->call_stack->frames[i].closure);
+  }
+  FORWARD(vm->openUpvalues);
+  for (ObjUpvalue *upvalue = vm->openUpvalues; upvalue != NULL; upvalue = upvalue->next) {
+    FORWARD(upvalue->next);
+  }
+  forwardTable(&vm->globals);
+  forwardArray(&vm->globalValues);
+  forwardTable(&vm->strings);
+  FORWARD(vm->rootShape);
+  for (int i = 0; i < vm->rememberedCount; i++) {
+    FORWARD(vm->remembered[i]);
+  }
+  for (int i = 0; i < vm->weakTableCount; i++) {
+    FORWARD(vm->weakTables[i]);
+  }
+
+  /* The objects themselves: small ones in the pages, whether young or old, then the large ones. */
+  for (Page *page = vm->pages; page != NULL; page = page->next) {
+    for (int i = 0; i < page->cellCount; i++) {
+      Object *object = PAGE_CELL(page, i);
+      if (object->mark != FREE_CELL) forwardFields(object, vm);
+    }
+  }
+  for (int i = 0; i < vm->youngCount; i++) {
+    FORWARD(vm->youngObjects[i]);
+    if (vm->youngObjects[i]->isLarge) forwardFields(vm->youngObjects[i], vm);
+  }
+  for (int i = 0; i < vm->largeCount; i++) {
+    forwardFields(vm->largeObjects[i], vm);
+  }
+  visitImmortal(forwardFields, vm);
+}
+
+/* Called at the safepoints in run() once a collection has asked for it. Has to wait while a
+   collection is in progress, the marking and the sweep both keep pointers into the heap. */
+void compactHeap(VM *vm) {
+  if (vm->gcPhase != GC_IDLE) return;
+  vm->compactPending = 0;
+  uint64_t start = nanosNow();
+  int count = vm->pageCount;
+  PageUsage *usage = (PageUsage *)malloc(sizeof(PageUsage) * (count > 0 ? count : 1));
+  if (usage == NULL) return; /* Not worth failing over. */
+
+  int index = 0;
+  for (Page *page = vm->pages; page != NULL; page = page->next) {
+    usage[index].page = page;
+    measurePage(&usage[index++]);
+  }
+  qsort(usage, count, sizeof(PageUsage), compareUsage);
+
+  /* The pages to empty are a run at the end of their size class: the longest one whose objects
+     fit in the free cells of the pages before it. */
+  Page *kept = NULL;
+  Page *emptied = NULL;
+  int released = 0;
+  for (int first = 0; first < count;) {
+    int cellSize = usage[first].page->cellSize;
+    int cellCount = usage[first].page->cellCount;
+    int end = first;
+    int keptFree = 0;
+    while (end < count && usage[end].page->cellSize == cellSize) {
+      keptFree += cellCount - usage[end].live;
+      end++;
+    }
+    int split = end;
+    int moving = 0;
+    while (split > first && !usage[split - 1].pinned) {
+      int live = usage[split - 1].live;
+      if (moving + live > keptFree - (cellCount - live)) break;
+      moving += live;
+      keptFree -= cellCount - live;
+      split--;
+    }
+    for (int i = first; i < end; i++) {
+      Page *page = usage[i].page;
+      if (i < split) {
+	page->next = kept;
+	kept = page;
       } else {
-	vm->objects = object;
+	page->next = emptied;
+	emptied = page;
+	released++;
       }
+    }
+    first = end;
+  }
+  free(usage);
+  vm->pages = kept;
+
+  /* Only the kept pages' cells are handed out from now on. */
+  for (int i = 0; i < GC_SIZE_CLASSES; i++) {
+    vm->freeCells[i] = NULL;
+  }
+  for (Page *page = kept; page != NULL; page = page->next) {
+    int sizeClass = SIZE_CLASS(page->cellSize);
+    for (int i = page->cellCount - 1; i >= 0; i--) {
+      FreeCell *cell = (FreeCell *)PAGE_CELL(page, i);
+      if (cell->obj.mark != FREE_CELL) continue;
+      cell->next = vm->freeCells[sizeClass];
+      vm->freeCells[sizeClass] = cell;
+    }
+  }
 
-      freeObject(unreached, vm);
+  if (emptied != NULL) {
+    for (Page *page = emptied; page != NULL; page = page->next) {
+      for (int i = 0; i < page->cellCount; i++) {
+	Object *object = PAGE_CELL(page, i);
+	if (object->mark != FREE_CELL) moveObject(object, SIZE_CLASS(page->cellSize), vm);
+      }
+    }
+    forwardReferences(vm);
+    while (emptied != NULL) {
+      Page *next = emptied->next;
+      free(emptied);
+      emptied = next;
     }
+    vm->pageCount -= released;
+    vm->stats.pagesReleased += released;
+  }
+#ifdef __GLIBC__
+  malloc_trim(0); /* Dead arrays and hash tables leave holes in malloc's heap too. */
+#endif
+
+  vm->stats.compactions++;
+  recordSince(&vm->stats.compactTime, start);
+  if (DEBUG_LOG_GC) {
+    printf("-- compacted\n");
+    printf("   released %d pages, %d left\n", released, vm->pageCount);
   }
 }
 
-void collectGarbage(VM *vm) {
+/* For native code that keeps an object's address somewhere the collector can't see, across calls
+   back into the VM. Pins nest, each pinObject() needs an unpinObject(), and an object pinned 255
+   times stays put for good. */
+void pinObject(Object *object) {
+  if (object->pinCount < UINT8_MAX) object->pinCount++;
+}
+
+void unpinObject(Object *object) {
+  if (object->pinCount > 0 && object->pinCount < UINT8_MAX) object->pinCount--;
+}
+
+/* Only looks at objects made since the last collection. Old objects are already marked, so
+   tracing stops at them, and the remembered set stands in for the old objects that might
+   point back at young ones. */
+void collectYoungGarbage(VM *vm) {
   if (DEBUG_LOG_GC) {
-    printf("-- gc begin\n");
+    printf("-- minor gc begin\n");
   }
   size_t before = vm->bytesAllocated;
+  uint64_t start = nanosNow();
   
   markRoots(vm);
+  for (int i = 0; i < vm->rememberedCount; i++) {
+    blackenObject(vm->remembered[i], &vm->gray, vm);
+  }
   traceReferences(vm);
-  tableRemoveWhite(&vm->strings);
-  sweep(vm);
+  recordSince(&vm->stats.markTime, start);
+  removeYoungWhiteReferences(vm);
+  sweepYoung(vm);
+  promoteYoung(vm);
+  forgetRemembered(vm);
 
-  vm->nextGC = vm->bytesAllocated * GC_HEAP_GROWTH_FACTOR;
+  vm->nurseryBytes = 0;
+  vm->minorsSinceMajor++;
+  vm->stats.minorCollections++;
+  recordSince(&vm->stats.minorPauses, start);
   
   if (DEBUG_LOG_GC) {
-    printf("-- gc end\n");
+    printf("-- minor gc end\n");
     printf("   collected %zu bytes (from %zu to %zu)\n", before - vm->bytesAllocated, before, vm->bytesAllocated);
   }
 }
+
+/* The young objects are swept as soon as marking is done, what's left for the sweep is the old
+   objects, which are either in a page or among the large objects. */
+static void startSweep(VM *vm) {
+  vm->gcPhase = GC_SWEEPING;
+  vm->sweepPage = vm->pages;
+  vm->sweepCell = 0;
+  vm->sweepLarge = 0;
+  vm->sweptBytes = 0;
+}
+
+static void sweepObject(Object *object, VM *vm) {
+  size_t before = vm->bytesAllocated;
+  freeObject(object, vm);
+  vm->sweptBytes += before - vm->bytesAllocated;
+  vm->stats.bytesFreed += before - vm->bytesAllocated;
+}
+
+/* Marks the whole heap in one go, but leaves the dead objects for the allocations that follow to
+   free, see collectIfNeeded(). Anything allocated in the meantime is young, so the
+   sweep never has to tell new objects from dead ones. */
+void collectGarbage(VM *vm) {
+  finishCycle(vm);
+  if (DEBUG_LOG_GC) {
+    printf("-- gc begin\n");
+  }
+  uint64_t start = nanosNow();
+
+  flipMarkColor(vm);
+  markRoots(vm);
+  markImmortalRoots(vm);
+  if (shouldMarkInParallel(vm)) {
+    traceReferencesParallel(vm);
+  } else {
+    traceReferences(vm);
+  }
+  recordSince(&vm->stats.markTime, start);
+  forgetRemembered(vm); /* Everything got traced anyway. */
+  removeWhiteReferences(vm);
+  sweepYoung(vm);
+  promoteYoung(vm);
+  startSweep(vm);
+  vm->nurseryBytes = 0;
+  vm->stats.majorCollections++;
+  recordSince(&vm->stats.majorPauses, start);
+  
+  if (DEBUG_LOG_GC) {
+    printf("-- gc marked\n");
+  }
+}
+
+/* Incremental major collections go through the same steps as collectGarbage(), but tracing and
+   sweeping happen a slice at a time between allocations. Only re-marking the roots at the end of
+   marking, and pruning the weak tables, happen in one go. */
+static void startCycle(VM *vm) {
+  if (DEBUG_LOG_GC) {
+    printf("-- incremental gc begin\n");
+  }
+  uint64_t start = nanosNow();
+  forgetRemembered(vm);
+  flipMarkColor(vm);
+  vm->gcPhase = GC_MARKING;
+  vm->stepBytes = 0;
+  markRoots(vm);
+  markImmortalRoots(vm);
+  vm->stats.majorCollections++;
+  recordSince(&vm->stats.markTime, start);
+  recordSince(&vm->stats.majorPauses, start);
+}
+
+/* The stack and globals get written without barriers, so they're marked again before the
+   marking can be called done. */
+static void finishMarking(VM *vm) {
+  uint64_t start = nanosNow();
+  markRoots(vm);
+  traceReferences(vm);
+  recordSince(&vm->stats.markTime, start);
+  removeWhiteReferences(vm);
+  sweepYoung(vm);
+  promoteYoung(vm);
+  startSweep(vm);
+}
+
+/* Pages made since the sweep started are left alone, everything in them is young. */
+static void sweepSome(int work, VM *vm) {
+  while (work-- > 0) {
+    if (vm->sweepPage != NULL) {
+      Page *page = vm->sweepPage;
+      Object *object = PAGE_CELL(page, vm->sweepCell);
+      if (++vm->sweepCell == page->cellCount) {
+	vm->sweepPage = page->next;
+	vm->sweepCell = 0;
+      }
+      if (object->mark != 0 && object->mark != FREE_CELL && object->mark != vm->markColor) {
+	sweepObject(object, vm);
+      }
+      continue;
+    }
+    
+    if (vm->sweepLarge == vm->largeCount) {
+      vm->gcPhase = GC_IDLE;
+      vm->sweepLarge = 0;
+      vm->nextGC = nextThreshold(vm);
+      vm->minorsSinceMajor = 0;
+      if (GC_COMPACT_THRESHOLD > 0 && pageFragmentation(vm) > GC_COMPACT_THRESHOLD) {
+	vm->compactPending = 1;
+      }
+      if (DEBUG_LOG_GC) {
+	printf("-- gc end\n");
+	printf("   swept %zu bytes, %zu left\n", vm->sweptBytes, vm->bytesAllocated);
+      }
+      return;
+    }
+    /* The last large object takes a dead one's place, so the array never has a hole in it.
+       Objects promoted meanwhile are added at the end, already marked. */
+    Object *object = vm->largeObjects[vm->sweepLarge];
+    if (object->mark == vm->markColor) {
+      vm->sweepLarge++;
+    } else {
+      vm->largeObjects[vm->sweepLarge] = vm->largeObjects[--vm->largeCount];
+      sweepObject(object, vm);
+    }
+  }
+}
+
+static void collectSome(int work, VM *vm) {
+  uint64_t start = nanosNow();
+  switch (vm->gcPhase) {
+  case GC_IDLE: break;
+  case GC_MARKING: {
+    int done = traceSome(work, vm);
+    recordSince(&vm->stats.markTime, start);
+    if (done) finishMarking(vm);
+  } break;
+  case GC_SWEEPING: {
+    sweepSome(work, vm);
+    recordSince(&vm->stats.sweepTime, start);
+  } break;
+  }
+}
+
+static void collectStep(VM *vm) {
+  vm->stepBytes = 0;
+  uint64_t start = nanosNow();
+  if (DEBUG_STRESS_GC) {
+    collectSome(1, vm);
+  } else {
+    clock_t deadline = clock() + (clock_t) GC_MAX_PAUSE * CLOCKS_PER_SEC / 1000000;
+    do {
+      collectSome(GC_SLICE_WORK, vm);
+    } while (vm->gcPhase != GC_IDLE && clock() < deadline);
+  }
+  recordSince(&vm->stats.majorPauses, start);
+}
+
+static void finishCycle(VM *vm) {
+  while (vm->gcPhase != GC_IDLE) {
+    collectSome(INT_MAX, vm);
+  }
+}
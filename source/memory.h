@@ -1,5 +1,7 @@
 #ifndef JOINT_MEMORY
 #define JOINT_MEMORY
+#include <stdio.h>
+
 #include "object.h"
 #include "table.h"
 #include "vm.h"
@@ -15,14 +17,34 @@
 #define FREE(type, pointer, vm)			\
   reallocate(pointer, sizeof(type), 0, vm)
 
+/* For objects that end in a flexible array member, with 'count' items in it. */
+#define FLEX_SIZE(type, itemType, count) (sizeof(type) + sizeof(itemType) * (count))
+
+#define FREE_OBJECT(type, pointer, vm)		\
+  freeCell(pointer, sizeof(type), vm)
+
+#define FREE_FLEX_OBJECT(type, itemType, pointer, count, vm)	\
+  freeCell(pointer, FLEX_SIZE(type, itemType, count), vm)
+
 #define ALLOCATE(type, count, vm)				\
   (type *)reallocate(NULL, 0, sizeof(type) * (count), vm)
 
 void *reallocate(void *pointer, size_t oldSize, size_t newSize, VM *vm);
+void *allocateCell(size_t size, VM *vm);
+void freeCell(void *cell, size_t size, VM *vm);
+Object *allocateImmortal(size_t size, ObjType type, VM *vm);
+void addYoungObject(Object *object, VM *vm);
 void markObject(Object *object, VM *vm);
 void markValue(Value value, VM *vm);
 void markTable(Table *table, VM *vm);
 void collectGarbage(VM *vm);
-void freeObjects(Object *start, VM *vm);
+void collectYoungGarbage(VM *vm);
+void freeObjects(VM *vm);
+void compactHeap(VM *vm);
+void pinObject(Object *object);
+void unpinObject(Object *object);
+void registerWeakTable(ObjTable *table, VM *vm);
+int internedStringCount(VM *vm);
+void printGcStats(VM *vm, FILE *file);
 
 #endif
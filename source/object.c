@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <math.h>
 
@@ -11,43 +12,164 @@
 #define ALLOCATE_OBJECT(type, objectType, vm)		\
   (type *)allocateObject(sizeof(type), objectType, vm)
 
-static Object *allocateObject(size_t size, ObjType objectType, VM *vm) {
-  Object *object = (Object *)reallocate(NULL, 0, size, vm);
+#define ALLOCATE_FLEX_OBJECT(type, itemType, count, objectType, vm)	\
+  (type *)allocateObject(FLEX_SIZE(type, itemType, count), objectType, vm)
+
+char *objectTypeName(ObjType type) {
+  switch(type) {
+  case OBJ_NATIVE: return "ObjNative";
+  case OBJ_STRING: return "ObjString";
+  case OBJ_FUNCTION: return "ObjFunction";
+  case OBJ_CLOSURE: return "ObjClosure";
+  case OBJ_UPVALUE: return "ObjUpvalue";
+  case OBJ_ARRAY: return "ObjArray";
+  case OBJ_TABLE: return "ObjTable";
+  case OBJ_SHAPE: return "ObjShape";
+  case OBJ_ROPE: return "ObjRope";
+  }
+  return "pleh";
+}
 
-  object->next = vm->objects;
-  vm->objects = object;
+/* Adds a freshly allocated object to the VM's young objects, where the collector can see it. */
+static Object *linkObject(Object *object, size_t size, ObjType objectType, VM *vm) {
+  addYoungObject(object, vm);
   object->type = objectType;
-  object->isMarked = 0;
+  object->mark = 0;
+  object->isRemembered = 0;
+  object->isLarge = size > GC_MAX_CELL_SIZE;
+  object->pinCount = 0;
+  vm->stats.liveObjects[objectType]++;
+  vm->stats.liveBytes[objectType] += size;
   
   if (DEBUG_LOG_GC) {
-    char *typeTag = "pleh";
-    switch(objectType) {
-    case OBJ_NATIVE: typeTag = "ObjNative"; break;
-    case OBJ_STRING: typeTag = "ObjString"; break;
-    case OBJ_FUNCTION: typeTag = "ObjFunction"; break;
-    case OBJ_CLOSURE: typeTag = "ObjClosure"; break;
-    case OBJ_UPVALUE: typeTag = "ObjUpvalue"; break;
-    case OBJ_ARRAY: typeTag = "ObjArray"; break;
-    case OBJ_TABLE: typeTag = "ObjTable"; break;
-    }
-    printf("%p allocate %zu for %s\n", (void *)object, size, typeTag);
+    printf("%p allocate %zu for %s\n", (void *)object, size, objectTypeName(objectType));
   }
   
   return object;
 }
 
+static Object *allocateObject(size_t size, ObjType objectType, VM *vm) {
+  if (vm->allocatingImmortal) return allocateImmortal(size, objectType, vm);
+  Object *object = (Object *)allocateCell(size, vm);
+  return linkObject(object, size, objectType, vm);
+}
+
 ObjArray *newArrayObject(VM *vm) {
   ObjArray *arrayObj = ALLOCATE_OBJECT(ObjArray, OBJ_ARRAY, vm);
-  initValueArray(&arrayObj->values);
+  arrayObj->storage = ARRAY_PACKED;
+  initNumberArray(&arrayObj->numbers);
   return arrayObj;
 }
 
 ObjTable *newTableObject(VM *vm) {
   ObjTable *tableObj = ALLOCATE_OBJECT(ObjTable, OBJ_TABLE, vm);
+  tableObj->shape = vm->rootShape;
+  tableObj->slots = NULL;
+  tableObj->slotCapacity = 0;
+  tableObj->weak = 0;
+  tableObj->pending = NULL;
+  tableObj->self = NULL;
   initTable(&tableObj->table);
   return tableObj;
 }
 
+static ShapeLayout *newShapeLayout(ObjShape *owner, VM *vm) {
+  ShapeLayout *layout = ALLOCATE(ShapeLayout, 1, vm);
+  layout->owner = owner;
+  layout->count = 0;
+  layout->capacity = 0;
+  layout->keys = NULL;
+  initTable(&layout->slots);
+  return layout;
+}
+
+static void appendToLayout(ShapeLayout *layout, ObjString *key, VM *vm) {
+  if (layout->capacity < layout->count + 1) {
+    int oldCapacity = layout->capacity;
+    int newCapacity = GROW_CAPACITY(oldCapacity);
+    layout->keys = GROW_ARRAY(ObjString *, layout->keys, oldCapacity, newCapacity, vm);
+    layout->capacity = newCapacity;
+  }
+  layout->keys[layout->count] = key;
+  tableSet(&layout->slots, key, NUMBER_VAL(layout->count), vm);
+  layout->count++;
+  writeBarrier((Object *)layout->owner, vm);
+}
+
+static ObjShape *allocateShape(ObjShape *parent, ObjString *key, VM *vm) {
+  ObjShape *shape = ALLOCATE_OBJECT(ObjShape, OBJ_SHAPE, vm);
+  shape->parent = parent;
+  shape->key = key;
+  shape->slotCount = parent == NULL ? 0 : parent->slotCount + 1;
+  shape->ownsLayout = 0;
+  shape->layout = NULL;
+  initTable(&shape->transitions);
+  return shape;
+}
+
+ObjShape *newRootShape(VM *vm) {
+  ObjShape *shape = allocateShape(NULL, NULL, vm);
+  push(getStack(vm), OBJECT_VAL(shape));
+  shape->layout = newShapeLayout(shape, vm);
+  shape->ownsLayout = 1;
+  pop(getStack(vm));
+  return shape;
+}
+
+static ObjShape *shapeTransition(ObjShape *shape, ObjString *key, VM *vm) {
+  Value child;
+  if (tableGet(&shape->transitions, key, &child)) {
+    return AS_SHAPE(child);
+  }
+
+  ObjShape *next = allocateShape(shape, key, vm);
+  push(getStack(vm), OBJECT_VAL(next)); /* Transitions are weak, so root it until it's in use. */
+  if (shape->layout->count == shape->slotCount) {
+    next->layout = shape->layout;
+  } else {
+    next->layout = newShapeLayout(next, vm);
+    next->ownsLayout = 1;
+    for (int i = 0; i < shape->slotCount; i++) {
+      appendToLayout(next->layout, shape->layout->keys[i], vm);
+    }
+  }
+  appendToLayout(next->layout, key, vm);
+  tableSet(&shape->transitions, key, OBJECT_VAL(next), vm);
+  pop(getStack(vm));
+  return next;
+}
+
+int shapeLookup(ObjShape *shape, ObjString *key) {
+  Value slot;
+  if (!tableGet(&shape->layout->slots, key, &slot)) return -1;
+  int index = (int) AS_NUMBER(slot);
+  return index < shape->slotCount ? index : -1; /* Later slots belong to some other shape down the chain. */
+}
+
+/* Called by the collector after marking. Nothing holds on to a shape through its parent's
+   transitions, so children that weren't marked are on their way out. */
+void shapeRemoveWhite(ObjShape *shape, VM *vm) {
+  Table *transitions = &shape->transitions;
+  for (int i = 0; i < transitions->count; i++) {
+    Entry *entry = &transitions->entries[i];
+    if (entry->key == NULL) continue;
+    ObjShape *child = AS_SHAPE(entry->value);
+    if (IS_MARKED(&child->obj, vm)) {
+      shapeRemoveWhite(child, vm);
+    } else {
+      tableDelete(transitions, entry->key);
+    }
+  }
+}
+
+/* The minor collector's version, for a young shape that wasn't marked. Only it can be dead, its
+   parent may well be old. */
+void shapeRemoveDead(ObjShape *shape, VM *vm) {
+  Value child;
+  if (shape->parent == NULL || !tableGet(&shape->parent->transitions, shape->key, &child)) return;
+  if (AS_SHAPE(child) == shape) tableDelete(&shape->parent->transitions, shape->key);
+}
+
 Value getFromArrayObject(ObjArray *array, Value index) {
   /* if (!IS_NUMBER(index)) {
     printf("Tried to index into array with something that isn't a number. What?")
@@ -56,12 +178,140 @@ Value getFromArrayObject(ObjArray *array, Value index) {
 	    checks for number indices and is better equipped to exit from errors. */
   double num_index = AS_NUMBER(index);
   int int_index = round(num_index);
-  return getFromValueArray(&array->values, int_index - 1);
+  switch (array->storage) {
+  case ARRAY_PACKED: return NUMBER_VAL(getFromNumberArray(&array->numbers, int_index - 1));
+  case ARRAY_SPARSE: return getFromSparseArray(&array->sparse, int_index - 1);
+  default: return getFromValueArray(&array->values, int_index - 1);
+  }
+}
+
+/* Boxes up the numbers of a packed array. The numbers stay put until the values are ready, in
+   case the allocation sets off a collection. */
+static void unpackArrayObject(ObjArray *array, VM *vm) {
+  int count = array->numbers.count;
+  int capacity = array->numbers.capacity;
+  Value *values = capacity > 0 ? ALLOCATE(Value, capacity, vm) : NULL;
+  for (int i = 0; i < count; i++) {
+    values[i] = NUMBER_VAL(array->numbers.values[i]);
+  }
+  freeNumberArray(&array->numbers, vm);
+  array->storage = ARRAY_BOXED;
+  array->values.count = count;
+  array->values.capacity = capacity;
+  array->values.values = values;
+}
+
+/* Unboxes an array again if everything in it is a number, for the array natives. Returns whether
+   the array is packed now. Sparse arrays always have nil holes, so they never are. */
+int packArrayObject(ObjArray *array, VM *vm) {
+  if (array->storage != ARRAY_BOXED) return array->storage == ARRAY_PACKED;
+  int count = array->values.count;
+  for (int i = 0; i < count; i++) {
+    if (!IS_NUMBER(array->values.values[i])) return 0;
+  }
+  int capacity = array->values.capacity;
+  double *numbers = capacity > 0 ? ALLOCATE(double, capacity, vm) : NULL;
+  for (int i = 0; i < count; i++) {
+    numbers[i] = AS_NUMBER(array->values.values[i]);
+  }
+  freeValueArray(&array->values, vm);
+  array->storage = ARRAY_PACKED;
+  array->numbers.count = count;
+  array->numbers.capacity = capacity;
+  array->numbers.values = numbers;
+  return 1;
+}
+
+/* The old storage is only let go of once the sparse one is filled in, for the same reason. */
+static void sparsifyArrayObject(ObjArray *array, VM *vm) {
+  SparseArray sparse;
+  initSparseArray(&sparse);
+  int count = arrayObjectCount(array);
+  for (int i = 0; i < count; i++) {
+    Value value = arrayObjectAt(array, i);
+    if (!IS_NIL(value)) writeSparseArray(&sparse, i + 1, value, vm);
+  }
+  sparse.count = count;
+  if (array->storage == ARRAY_PACKED) {
+    freeNumberArray(&array->numbers, vm);
+  } else {
+    freeValueArray(&array->values, vm);
+  }
+  array->storage = ARRAY_SPARSE;
+  array->sparse = sparse;
+}
+
+static void densifyArrayObject(ObjArray *array, VM *vm) {
+  int count = array->sparse.count;
+  Value *values = ALLOCATE(Value, count, vm);
+  for (int i = 0; i < count; i++) {
+    values[i] = NIL_VAL;
+  }
+  for (int i = 0; i < array->sparse.capacity; i++) {
+    SparseEntry *entry = &array->sparse.entries[i];
+    if (entry->index != 0) values[entry->index - 1] = entry->value;
+  }
+  freeSparseArray(&array->sparse, vm);
+  array->storage = ARRAY_BOXED;
+  array->values.count = count;
+  array->values.capacity = count;
+  array->values.values = values;
+}
+
+void appendToArrayObject(ObjArray *array, Value value, VM *vm) {
+  if (array->storage == ARRAY_PACKED && !IS_NUMBER(value)) unpackArrayObject(array, vm);
+  switch (array->storage) {
+  case ARRAY_PACKED: writeNumberArray(&array->numbers, AS_NUMBER(value), vm); break;
+  case ARRAY_BOXED: {
+    writeValueArray(&array->values, value, vm);
+    writeBarrier((Object *)array, vm);
+  } break;
+  case ARRAY_SPARSE: setInArrayObject(array, NUMBER_VAL(array->sparse.count + 1), value, vm); break;
+  }
+}
+
+int arrayObjectCount(ObjArray *array) {
+  switch (array->storage) {
+  case ARRAY_PACKED: return array->numbers.count;
+  case ARRAY_SPARSE: return array->sparse.count;
+  default: return array->values.count;
+  }
+}
+
+/* 'index' starts from 0 and has to be in range. */
+Value arrayObjectAt(ObjArray *array, int index) {
+  switch (array->storage) {
+  case ARRAY_PACKED: return NUMBER_VAL(array->numbers.values[index]);
+  case ARRAY_SPARSE: return getFromSparseArray(&array->sparse, index);
+  default: return array->values.values[index];
+  }
 }
 
 void setInArrayObject(ObjArray *array, Value index, Value value, VM *vm) {
   double num_index = AS_NUMBER(index);
   int int_index = round(num_index);
+  int count = arrayObjectCount(array);
+  if (array->storage != ARRAY_SPARSE && int_index - count > ARRAY_SPARSE_GAP && int_index > 2 * count) {
+    sparsifyArrayObject(array, vm);
+  }
+  if (array->storage == ARRAY_SPARSE) {
+    writeSparseArray(&array->sparse, int_index, value, vm);
+    if (array->sparse.used * 2 >= array->sparse.count) densifyArrayObject(array, vm);
+    writeBarrier((Object *)array, vm);
+    return;
+  }
+  if (array->storage == ARRAY_PACKED) {
+    /* The gap up to a store past the end gets filled with nils, which can't be packed. */
+    if (IS_NUMBER(value) && int_index <= array->numbers.count + 1) {
+      if (int_index > array->numbers.count) {
+	writeNumberArray(&array->numbers, AS_NUMBER(value), vm);
+      } else {
+	array->numbers.values[int_index - 1] = AS_NUMBER(value);
+      }
+      return;
+    }
+    unpackArrayObject(array, vm);
+  }
   if (int_index > array->values.count) {
     while (array->values.count < int_index - 1) {
       writeValueArray(&array->values, NIL_VAL, vm);
@@ -70,10 +320,18 @@ void setInArrayObject(ObjArray *array, Value index, Value value, VM *vm) {
   } else {
     array->values.values[int_index - 1] = value;
   }
+  writeBarrier((Object *)array, vm);
 }
 
-Value getFromTableObject(ObjTable *table, ObjString *key) {
+Value getFromTableObject(ObjTable *table, ObjString *key, VM *vm) {
   Value value;
+  if (table->shape != NULL) {
+    int slot = shapeLookup(table->shape, key);
+    if (slot == -1) return NIL_VAL;
+    value = table->slots->values[slot];
+    if (table->pending != NULL && IS_CLOSURE(value)) return bindMethod(table, slot, vm);
+    return value;
+  }
   if (tableGet(&table->table, key, &value)) {
     return value;
   } else {
@@ -82,18 +340,302 @@ Value getFromTableObject(ObjTable *table, ObjString *key) {
   }
 }
 
+#define SLOTS_SIZE(capacity) FLEX_SIZE(TableSlots, Value, capacity)
+
+/* Makes room for 'count' slots. Slots shared with a duplicate get copied instead, even when
+   there's room already, so that nothing written afterwards shows through to the other table. */
+void tableObjectGrowSlots(ObjTable *table, int count, VM *vm) {
+  int oldCapacity = table->slotCapacity;
+  int newCapacity = oldCapacity;
+  if (newCapacity < count) {
+    newCapacity = GROW_CAPACITY(oldCapacity);
+    while (newCapacity < count) {
+      newCapacity = GROW_CAPACITY(newCapacity);
+    }
+  }
+  TableSlots *slots = table->slots;
+  if (slots == NULL || slots->refCount == 1) {
+    table->slots = reallocate(slots, slots == NULL ? 0 : SLOTS_SIZE(oldCapacity), SLOTS_SIZE(newCapacity), vm);
+    table->slots->refCount = 1;
+  } else {
+    TableSlots *copy = reallocate(NULL, 0, SLOTS_SIZE(newCapacity), vm);
+    copy->refCount = 1;
+    memcpy(copy->values, slots->values, sizeof(Value) * table->shape->slotCount);
+    table->slots = copy;
+    /* The collection above may have freed the other tables using them. */
+    releaseTableSlots(slots, oldCapacity, vm);
+  }
+  table->slotCapacity = newCapacity;
+}
+
+void releaseTableSlots(TableSlots *slots, int capacity, VM *vm) {
+  if (slots != NULL && --slots->refCount == 0) {
+    reallocate(slots, SLOTS_SIZE(capacity), 0, vm);
+  }
+}
+
+/* The slot array has to be big enough before the table moves to the new shape, otherwise the
+   collector could go looking at a slot that isn't there. */
+static ObjShape *addKeyToShape(ObjTable *table, ObjString *key, Value value, VM *vm) {
+  ObjShape *shape = table->shape;
+  if (table->pending != NULL && IS_CLOSURE(value)) bindAllMethods(table, vm);
+  if (table->slotCapacity < shape->slotCount + 1 || table->slots->refCount > 1) {
+    tableObjectGrowSlots(table, shape->slotCount + 1, vm);
+  }
+  ObjShape *next = shapeTransition(shape, key, vm);
+  table->slots->values[shape->slotCount] = value;
+  table->shape = next;
+  writeBarrier((Object *)table, vm);
+  return next;
+}
+
+void tableObjectToDictionary(ObjTable *table, VM *vm) {
+  ObjShape *shape = table->shape;
+  if (shape == NULL) return;
+  bindAllMethods(table, vm);
+  for (int i = 0; i < shape->slotCount; i++) {
+    tableSet(&table->table, shape->layout->keys[i], table->slots->values[i], vm);
+  }
+  releaseTableSlots(table->slots, table->slotCapacity, vm);
+  table->slots = NULL;
+  table->slotCapacity = 0;
+  table->shape = NULL;
+  writeBarrier((Object *)table, vm);
+}
+
+/* A weak table doesn't keep its values alive: with WEAK_VALUES an entry goes once nothing else
+   holds on to its value, unless that's a number, logic value or string, see HOLDS_WEAKLY(). Keys
+   are strings, so they're always kept. The collector clears those entries out after marking, see
+   pruneWeakTables(). Weak tables are always dictionaries, so all of their entries are in one place
+   for it. There's no making a table strong again. */
+void makeTableObjectWeak(ObjTable *table, int weak, VM *vm) {
+  tableObjectToDictionary(table, vm);
+  if (table->weak == 0) registerWeakTable(table, vm);
+  table->weak = weak;
+}
+
 void setInTableObject(ObjTable *table, ObjString *key, Value value, VM *vm) {
+  if (table->shape != NULL) {
+    int slot = shapeLookup(table->shape, key);
+    if (slot != -1) {
+      if (table->pending != NULL && IS_CLOSURE(value)) bindAllMethods(table, vm);
+      if (table->slots->refCount > 1) tableObjectGrowSlots(table, table->slotCapacity, vm);
+      table->slots->values[slot] = value;
+      writeBarrier((Object *)table, vm);
+      return;
+    }
+    if (table->shape->slotCount < SHAPE_MAX_SLOTS) {
+      addKeyToShape(table, key, value, vm);
+      return;
+    }
+    tableObjectToDictionary(table, vm);
+  }
   tableSet(&table->table, key, value, vm);
+  writeBarrier((Object *)table, vm);
 }
 
-int tableObjectGetN(ObjTable *table, Value number, Value *value, Value *key) {
-  double num_number = AS_NUMBER(number);
-  int int_num = round(num_number);
-  if (tableGetN(&table->table, int_num, value, key)) {
+/* Fills an empty way if there is one. Once a site has seen more shapes than it has ways, the
+   last way just keeps getting replaced. Caches live in functions, which are usually old by now
+   and have no barrier of their own, so the shapes are made old as they go in. */
+static void fillCache(InlineCache *cache, ObjShape *shape, ObjShape *transition, int slot, VM *vm) {
+  tenureObject((Object *)shape, vm);
+  tenureObject((Object *)transition, vm);
+  InlineCacheEntry *entry = &cache->entries[INLINE_CACHE_WAYS - 1];
+  for (int i = 0; i < INLINE_CACHE_WAYS; i++) {
+    if (cache->entries[i].shape == NULL) {
+      entry = &cache->entries[i];
+      break;
+    }
+  }
+  entry->shape = shape;
+  entry->transition = transition;
+  entry->slot = slot;
+}
+
+Value getFromTableObjectMiss(ObjTable *table, ObjString *key, InlineCache *cache, VM *vm) {
+  if (table->shape == NULL) return getFromTableObject(table, key, vm);
+
+  int slot = shapeLookup(table->shape, key);
+  if (slot == -1) return NIL_VAL;
+  fillCache(cache, table->shape, NULL, slot, vm);
+  Value value = table->slots->values[slot];
+  if (table->pending != NULL && IS_CLOSURE(value)) return bindMethod(table, slot, vm);
+  return value;
+}
+
+void setInTableObjectMiss(ObjTable *table, ObjString *key, Value value, InlineCache *cache, VM *vm) {
+  ObjShape *shape = table->shape;
+  if (shape != NULL) {
+    int slot = shapeLookup(shape, key);
+    if (slot != -1) {
+      if (table->pending != NULL && IS_CLOSURE(value)) bindAllMethods(table, vm);
+      if (table->slots->refCount > 1) tableObjectGrowSlots(table, table->slotCapacity, vm);
+      table->slots->values[slot] = value;
+      writeBarrier((Object *)table, vm);
+      fillCache(cache, shape, NULL, slot, vm);
+      return;
+    }
+    if (shape->slotCount < SHAPE_MAX_SLOTS) {
+      ObjShape *next = addKeyToShape(table, key, value, vm);
+      fillCache(cache, shape, next, shape->slotCount, vm);
+      return;
+    }
+  }
+  setInTableObject(table, key, value, vm);
+}
+
+#define PENDING_SIZE(capacity) FLEX_SIZE(PendingMethods, ObjUpvalue *, capacity)
+
+static int isPendingUpvalue(PendingMethods *pending, ObjUpvalue *upvalue) {
+  for (int i = 0; i < pending->count; i++) {
+    if (pending->upvalues[i] == upvalue) return 1;
+  }
+  return 0;
+}
+
+/* Goes over the upvalues of the source's methods that hold the source. Counts every one of them
+   when 'pending' is NULL, otherwise puts each different one in it. */
+static int findSourceUpvalues(ObjTable *source, PendingMethods *pending) {
+  int count = 0;
+  for (int i = 0; i < source->shape->slotCount; i++) {
+    Value value = source->slots->values[i];
+    if (!IS_CLOSURE(value)) continue;
+    ObjClosure *method = AS_CLOSURE(value);
+    for (int j = 0; j < method->upvalueCount; j++) {
+      ObjUpvalue *upvalue = method->upvalues[j];
+      Value captured = *upvalue->location;
+      if (!IS_OBJECT(captured) || AS_OBJECT(captured) != (Object *)source) continue;
+      count++;
+      if (pending != NULL && !isPendingUpvalue(pending, upvalue)) {
+	pending->upvalues[pending->count++] = upvalue;
+      }
+    }
+  }
+  return count;
+}
+
+/* Duplicates a table without copying it. The copy starts out with the same shape and the same
+   slots as the source, and the first write to either of them copies the slots (see
+   tableObjectGrowSlots()). Methods that close over the source are rebound to the copy one at a
+   time, as they get fetched out of it (see bindMethod()). Dictionaries still get copied entry
+   by entry, see duplicateTable(). */
+ObjTable *cloneTableObject(ObjTable *source, VM *vm) {
+  /* A copy's own methods only capture it once they are rebound. */
+  bindAllMethods(source, vm);
+
+  /* Which upvalues hold the source is decided now, like an eager copy would: they can be
+     assigned to before the methods get fetched. */
+  PendingMethods *pending = NULL;
+  int capacity = findSourceUpvalues(source, NULL);
+  if (capacity > 0) {
+    pending = reallocate(NULL, 0, PENDING_SIZE(capacity), vm);
+    pending->count = 0;
+    pending->capacity = capacity;
+    findSourceUpvalues(source, pending);
+  }
+
+  ObjTable *clone = newTableObject(vm);
+  clone->shape = source->shape;
+  clone->slots = source->slots;
+  clone->slotCapacity = source->slotCapacity;
+  if (clone->slots != NULL) clone->slots->refCount++;
+  clone->pending = pending;
+  return clone;
+}
+
+static int capturesPending(ObjClosure *closure, PendingMethods *pending) {
+  for (int i = 0; i < closure->upvalueCount; i++) {
+    if (isPendingUpvalue(pending, closure->upvalues[i])) return 1;
+  }
+  return 0;
+}
+
+/* Rebinds the closure in 'slot' of a duplicated table, pointing the upvalues that held the
+   source at the table itself instead, and keeps the result in the slot for next time. */
+Value bindMethod(ObjTable *table, int slot, VM *vm) {
+  ObjClosure *method = AS_CLOSURE(table->slots->values[slot]);
+  if (!capturesPending(method, table->pending)) return OBJECT_VAL(method);
+
+  if (table->self == NULL) {
+    ObjUpvalue *self = newUpvalue(NULL, vm);
+    self->closed = OBJECT_VAL(table);
+    self->location = &self->closed;
+    table->self = self;
+    writeBarrier((Object *)table, vm);
+  }
+  ObjClosure *bound = newClosure(method->function, vm);
+  for (int i = 0; i < method->upvalueCount; i++) {
+    if (isPendingUpvalue(table->pending, method->upvalues[i])) {
+      bound->upvalues[i] = table->self;
+    } else {
+      bound->upvalues[i] = method->upvalues[i];
+    }
+  }
+  push(getStack(vm), OBJECT_VAL(bound));
+  if (table->slots->refCount > 1) tableObjectGrowSlots(table, table->slotCapacity, vm);
+  table->slots->values[slot] = OBJECT_VAL(bound);
+  writeBarrier((Object *)table, vm);
+  pop(getStack(vm));
+  return OBJECT_VAL(bound);
+}
+
+/* Rebinds whatever methods a duplicated table still has pending. Needed before a closure gets
+   stored in it, which would otherwise be taken for one of them. */
+void bindAllMethods(ObjTable *table, VM *vm) {
+  if (table->pending == NULL) return;
+  for (int i = 0; i < table->shape->slotCount; i++) {
+    if (IS_CLOSURE(table->slots->values[i])) bindMethod(table, i, vm);
+  }
+  releasePendingMethods(table, vm);
+}
+
+void releasePendingMethods(ObjTable *table, VM *vm) {
+  if (table->pending == NULL) return;
+  reallocate(table->pending, PENDING_SIZE(table->pending->capacity), 0, vm);
+  table->pending = NULL;
+}
+
+int tableObjectCount(ObjTable *table) {
+  return table->shape != NULL ? table->shape->slotCount : table->table.count;
+}
+
+/* Steps through a table's entries, in the order the keys were added for tables that still have
+   a shape. Start the cursor at 0; returns 0 once there's nothing left. */
+int tableObjectNext(ObjTable *table, int *cursor, ObjString **key, Value *value, VM *vm) {
+  if (table->shape != NULL) {
+    if (*cursor >= table->shape->slotCount) return 0;
+    *key = table->shape->layout->keys[*cursor];
+    *value = table->slots->values[*cursor];
+    if (table->pending != NULL && IS_CLOSURE(*value)) *value = bindMethod(table, *cursor, vm);
+    (*cursor)++;
     return 1;
-  } else {
-    return 0;
   }
+  while (*cursor < table->table.count) {
+    Entry *entry = &table->table.entries[(*cursor)++];
+    if (entry->key != NULL) {
+      *key = entry->key;
+      *value = entry->value;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+void printTableObject(ObjTable *table) {
+  if (table->shape == NULL) {
+    printTable(&table->table);
+    return;
+  }
+  printf(":[ ");
+  for (int i = 0; i < table->shape->slotCount; i++) {
+    if (i > 0) {
+      printf(", ");
+    }
+    printf("%s", table->shape->layout->keys[i]->chars);
+    printf(" : ");
+    printValue(table->slots->values[i]);
+  }
+  printf(" ]");
 }
 
 ObjFunction *newFunction(VM *vm) {
@@ -112,14 +654,12 @@ ObjNative *newNative(libFn function, VM *vm) {
 }
 
 ObjClosure *newClosure(ObjFunction *function, VM *vm) {
-  ObjUpvalue **upvalues = ALLOCATE(ObjUpvalue *, function->upvalueCount, vm);
-  for (int i = 0; i < function->upvalueCount; i++) {
-    upvalues[i] = NULL;
-  }
-  ObjClosure *closure = ALLOCATE_OBJECT(ObjClosure, OBJ_CLOSURE, vm);
+  ObjClosure *closure = ALLOCATE_FLEX_OBJECT(ObjClosure, ObjUpvalue *, function->upvalueCount, OBJ_CLOSURE, vm);
   closure->function = function;
-  closure->upvalues = upvalues;
   closure->upvalueCount = function->upvalueCount;
+  for (int i = 0; i < function->upvalueCount; i++) {
+    closure->upvalues[i] = NULL;
+  }
   return closure;
 }
 
@@ -131,10 +671,8 @@ ObjUpvalue *newUpvalue(Value *slot, VM *vm) {
   return upvalue;
 }
 
-static ObjString *allocateString(char *chars, int length, uint32_t hash, VM *vm) {
-  ObjString *string = ALLOCATE_OBJECT(ObjString, OBJ_STRING, vm);
-  string->length = length;
-  string->chars = chars;
+/* Interns a string whose object has already been linked in. */
+static ObjString *internString(ObjString *string, uint32_t hash, VM *vm) {
   string->hash = hash;
   push(getStack(vm), OBJECT_VAL(string));
   tableSet(&vm->strings, string, NIL_VAL, vm); /* Put the string in the string table */
@@ -151,6 +689,94 @@ void printFunction(ObjFunction *function) {
   printf("<fn %s>", function->name->chars);
 }
 
+static int ropeLength(Object *object) {
+  return object->type == OBJ_ROPE ? ((ObjRope *)object)->length : ((ObjString *)object)->length;
+}
+
+/* Writes out the characters of a rope back to front. The pieces still to be copied go on a
+   little stack instead of recursing, since a string built up in a loop makes a rope as deep
+   as the loop ran. */
+static void copyRopeChars(ObjRope *rope, char *dest) {
+  int capacity = 8;
+  int count = 0;
+  Object **pending = malloc(sizeof(Object *) * capacity);
+  if (pending == NULL) {
+    fprintf(stderr, "Ran out of memory flattening a string. RIP\n");
+    exit(1);
+  }
+  
+  char *end = dest + rope->length;
+  pending[count++] = (Object *)rope;
+  while (count > 0) {
+    Object *object = pending[--count];
+    if (object->type == OBJ_ROPE && ((ObjRope *)object)->flat != NULL) {
+      object = (Object *)((ObjRope *)object)->flat;
+    }
+    
+    if (object->type == OBJ_STRING) {
+      ObjString *string = (ObjString *)object;
+      end -= string->length;
+      memcpy(end, string->chars, string->length);
+      continue;
+    }
+
+    if (count + 2 > capacity) {
+      capacity *= 2;
+      pending = realloc(pending, sizeof(Object *) * capacity);
+      if (pending == NULL) {
+	fprintf(stderr, "Ran out of memory flattening a string. RIP\n");
+	exit(1);
+      }
+    }
+    pending[count++] = ((ObjRope *)object)->left;
+    pending[count++] = ((ObjRope *)object)->right; /* Right goes on top, it's copied first. */
+  }
+  
+  free(pending);
+}
+
+ObjRope *newRope(Object *left, Object *right, VM *vm) {
+  /* Point past halves that are already flat, so they can let go of their own children. */
+  if (left->type == OBJ_ROPE && ((ObjRope *)left)->flat != NULL) left = (Object *)((ObjRope *)left)->flat;
+  if (right->type == OBJ_ROPE && ((ObjRope *)right)->flat != NULL) right = (Object *)((ObjRope *)right)->flat;
+  
+  ObjRope *rope = ALLOCATE_OBJECT(ObjRope, OBJ_ROPE, vm);
+  rope->length = ropeLength(left) + ropeLength(right);
+  rope->left = left;
+  rope->right = right;
+  rope->flat = NULL;
+  return rope;
+}
+
+/* The rope has to be reachable by the collector while this runs. */
+ObjString *flattenRope(ObjRope *rope, VM *vm) {
+  if (rope->flat != NULL) return rope->flat;
+
+  char *chars = reserveString(rope->length, vm);
+  copyRopeChars(rope, chars);
+  rope->flat = takeString(chars, rope->length, vm);
+  rope->left = NULL;
+  rope->right = NULL;
+  writeBarrier((Object *)rope, vm);
+  return rope->flat;
+}
+
+static void printRope(ObjRope *rope) {
+  if (rope->flat != NULL) {
+    printf("%s", rope->flat->chars);
+    return;
+  }
+  
+  char *chars = malloc(rope->length);
+  if (chars == NULL) {
+    fprintf(stderr, "Ran out of memory printing a string. RIP\n");
+    exit(1);
+  }
+  copyRopeChars(rope, chars);
+  fwrite(chars, 1, rope->length, stdout);
+  free(chars);
+}
+
 void printObject(Value object) {
   switch (OBJ_TYPE(object)) {
   case OBJ_STRING: printf("%s", AS_CSTRING(object)); break;
@@ -161,18 +787,21 @@ void printObject(Value object) {
   case OBJ_CLOSURE: printFunction(AS_CLOSURE(object)->function); break;
   case OBJ_UPVALUE: printf("upvalue"); break;
   case OBJ_ARRAY: {
-    ValueArray *array = &AS_ARRAY(object)->values;
+    ObjArray *array = AS_ARRAY(object);
+    int count = arrayObjectCount(array);
     printf("[ ");
-    for (int i = 0; i < array->count - 1; i++) {
-      printValue(array->values[i]);
+    for (int i = 0; i < count - 1; i++) {
+      printValue(arrayObjectAt(array, i));
       printf(", ");
     }
-    if (array->count > 0) {
-      printValue(array->values[array->count - 1]);
+    if (count > 0) {
+      printValue(arrayObjectAt(array, count - 1));
     }
     printf(" ]");
   } break;
-  case OBJ_TABLE: printTable(&AS_TABLE(object)->table);
+  case OBJ_TABLE: printTableObject(AS_TABLE(object)); break;
+  case OBJ_SHAPE: printf("<shape>"); break;
+  case OBJ_ROPE: printRope(AS_ROPE(object)); break;
   }
 }
 
@@ -190,21 +819,33 @@ ObjString *copyString(char *chars, int length, VM *vm) {
   ObjString *interned = tableFindString(&vm->strings, chars, length, hash);
   if (interned != NULL) return interned;
   
-  char *heapChars = ALLOCATE(char, length+1, vm);
-  memcpy(heapChars, chars, length);
-  heapChars[length] = '\0';
-  return allocateString(heapChars, length, hash, vm);
-  
+  ObjString *string = ALLOCATE_FLEX_OBJECT(ObjString, char, length + 1, OBJ_STRING, vm);
+  string->length = length;
+  memcpy(string->chars, chars, length);
+  string->chars[length] = '\0';
+  return internString(string, hash, vm);
+}
+
+/* Hands out a buffer for building a string in place. Fill in all 'length' characters, then
+   give it to takeString(). The buffer is the inside of a string object that isn't on the
+   object list yet, so nothing else may be done with it. */
+char *reserveString(int length, VM *vm) {
+  ObjString *string = (ObjString *)allocateCell(FLEX_SIZE(ObjString, char, length + 1), vm);
+  string->length = length;
+  string->chars[length] = '\0';
+  return string->chars;
 }
 
 ObjString *takeString(char *chars, int length, VM *vm) {
+  ObjString *string = (ObjString *)(chars - offsetof(ObjString, chars));
   uint32_t hash = hashString(chars, length);
   ObjString *interned = tableFindString(&vm->strings, chars, length, hash);
 
   if (interned != NULL) {
-    FREE_ARRAY(char, chars, length+1, vm);
+    FREE_FLEX_OBJECT(ObjString, char, string, length + 1, vm);
     return interned;
   }
-  
-  return allocateString(chars, length, hash, vm);
+
+  linkObject((Object *)string, FLEX_SIZE(ObjString, char, length + 1), OBJ_STRING, vm);
+  return internString(string, hash, vm);
 }
@@ -7,6 +7,21 @@ typedef struct libFn libFn;
 typedef struct ObjClosure ObjClosure;
 typedef struct ObjUpvalue ObjUpvalue;
 
+typedef enum {
+  OBJ_NATIVE,
+  OBJ_STRING,
+  OBJ_FUNCTION,
+  OBJ_CLOSURE,
+  OBJ_UPVALUE,
+  OBJ_ARRAY,
+  OBJ_TABLE,
+  OBJ_SHAPE,
+  OBJ_ROPE,
+} ObjType;
+
+#define OBJ_TYPE_COUNT (OBJ_ROPE + 1)
+
+/* Before the includes, vm.h needs OBJ_TYPE_COUNT and gets included through library.h. */
 #include "library.h"
 #include "common.h"
 #include "chunk.h"
@@ -17,21 +32,28 @@ typedef struct ObjUpvalue ObjUpvalue;
 
 #define OBJ_TYPE(value) (AS_OBJECT(value)->type)
 
-typedef enum {
-  OBJ_NATIVE,
-  OBJ_STRING,
-  OBJ_FUNCTION,
-  OBJ_CLOSURE,
-  OBJ_UPVALUE,
-  OBJ_ARRAY,
-  OBJ_TABLE,
-} ObjType;
+/* The mark of objects in the immortal region, which count as marked by every collection. See
+   allocateImmortal(). */
+#define IMMORTAL_MARK 3
+
+#define IS_MARKED(object, vm) ((object)->mark == (vm)->markColor || (object)->mark == IMMORTAL_MARK)
 
+/* The collector is generational without moving anything. An object is old once it has
+   survived a collection, and old objects keep their mark between collections, so a minor
+   collection stops tracing wherever it reaches one. Marks are colors rather than flags: a major
+   collection flips the VM's markColor, which unmarks every old object at once without having
+   to visit them.
 
+   The header is a single 8 byte word. Objects aren't linked together, the collector finds them
+   by going through the pages and the immortal region, and keeps the young and the large ones in
+   arrays of its own. The fields stay whole bytes rather than bit fields so parallel markers can
+   claim a mark with one atomic exchange. */
 struct Object {
   ObjType type;
-  int isMarked;
-  Object *next;
+  uint8_t mark; /* 0 while young, then the markColor of the last collection that reached it, or IMMORTAL_MARK. */
+  uint8_t isRemembered; /* Already in the VM's remembered set. */
+  uint8_t isLarge; /* Allocated on its own instead of in a page, see allocateCell(). */
+  uint8_t pinCount; /* Compaction won't move the object while this is above 0, see pinObject(). */
 };
 
 struct ObjFunction {
@@ -49,21 +71,100 @@ typedef struct {
   libFn function;
 } ObjNative;
 
+typedef enum {
+  ARRAY_PACKED,
+  ARRAY_BOXED,
+  ARRAY_SPARSE,
+} ArrayStorage;
+
+/* An array that has only ever held numbers keeps them unboxed in 'numbers', where the collector
+   has nothing to look at and the array natives can work on them directly. The first store of
+   anything else moves it over to 'values', where it stays unless an array native finds only
+   numbers in it again. Either one turns into a 'sparse' array when something gets stored far
+   past its end, see setInArrayObject(). */
 struct ObjArray {
   Object obj;
-  ValueArray values;
+  ArrayStorage storage;
+  union {
+    ValueArray values;
+    NumberArray numbers;
+    SparseArray sparse;
+  };
+};
+
+/* A shape describes which keys a table has and which slot each one lives in. Adding a key moves a
+   table to a child shape, and the children are cached on the parent, so tables that get the same
+   keys in the same order end up sharing one shape.
+
+   The key list and key -> slot map are shared down a chain of shapes: a child that extends the
+   last key of its parent's layout just appends to it, since a shape only looks at the first
+   slotCount entries. A shape that branches off somewhere else copies the part it needs. The
+   shape that created a layout owns it, and it's always an ancestor of the shapes borrowing it. */
+typedef struct {
+  ObjShape *owner;
+  int count;
+  int capacity;
+  ObjString **keys; /* In slot order. */
+  Table slots; /* Key -> slot number. */
+} ShapeLayout;
+
+struct ObjShape {
+  Object obj;
+  ObjShape *parent;
+  ObjString *key; /* The key added on top of the parent, NULL for the root. */
+  int slotCount;
+  int ownsLayout;
+  ShapeLayout *layout;
+  Table transitions; /* Key -> child shape. Weak, the collector prunes dead children. */
 };
 
+/* The values of a table's slots. Duplicating a table shares them between the two until either
+   one writes to them, see cloneTableObject(). */
+typedef struct {
+  int refCount;
+  Value values[];
+} TableSlots;
+
+/* The upvalues that held the source table when a copy of it was made. The copy's methods that
+   capture one of them still have to be rebound to the copy, see bindMethod(). */
+typedef struct {
+  int count;
+  int capacity;
+  ObjUpvalue *upvalues[];
+} PendingMethods;
+
+/* Tables start out with a shape and a dense slot array. Ones that get too big, or that get keys
+   added with calculated access, drop their shape (shape == NULL) and keep everything in 'table'. */
 struct ObjTable {
   Object obj;
+  ObjShape *shape;
+  TableSlots *slots;
+  int slotCapacity;
+  int weak; /* WEAK_VALUES, see makeTableObjectWeak(). */
+  PendingMethods *pending; /* Set on a copy until all its methods are rebound. */
+  ObjUpvalue *self; /* Closed over the table itself, for the methods rebound to it. */
   Table table;
 };
 
+#define WEAK_VALUES 1
+
 struct ObjString {
   Object obj;
   int length;
   uint32_t hash;
-  char *chars;
+  char chars[]; /* length + 1 with the terminating NUL, allocated along with the object. */
+};
+
+/* The result of adding strings together, kept as its two halves so building a long string a
+   piece at a time doesn't copy it over and over. A rope gets flattened into a real, interned
+   string the first time something needs the characters: table keys, comparisons, printing and
+   natives. Scripts never see the difference, they get the same string either way. */
+struct ObjRope {
+  Object obj;
+  int length;
+  Object *left; /* ObjString or ObjRope, both NULL once the rope has been flattened. */
+  Object *right;
+  ObjString *flat; /* NULL until the rope is flattened. */
 };
 
 typedef struct ObjUpvalue ObjUpvalue;
@@ -78,8 +179,8 @@ struct ObjUpvalue {
 struct ObjClosure {
   Object obj;
   ObjFunction *function;
-  ObjUpvalue **upvalues;
   int upvalueCount;
+  ObjUpvalue *upvalues[];
 };
 
 static inline int isObjType(Value value, ObjType type) {
@@ -101,22 +202,103 @@ static inline int isObjType(Value value, ObjType type) {
 #define IS_TABLE(value) isObjType(value, OBJ_TABLE)
 #define AS_TABLE(value) ((ObjTable *)AS_OBJECT(value))
 
+#define IS_SHAPE(value) isObjType(value, OBJ_SHAPE)
+#define AS_SHAPE(value) ((ObjShape *)AS_OBJECT(value))
+
+#define IS_ROPE(value) isObjType(value, OBJ_ROPE)
+#define AS_ROPE(value) ((ObjRope *)AS_OBJECT(value))
+
 #define IS_STRING(value) isObjType(value, OBJ_STRING)
 #define AS_STRING(value) ((ObjString *)AS_OBJECT(value))
 #define AS_CSTRING(value) (((ObjString *)AS_OBJECT(value))->chars)
 
+/* What a weak table lets go of. Strings are values, an equal one made later is the same value,
+   so like numbers they're never cleared out. */
+#define HOLDS_WEAKLY(value) (IS_OBJECT(value) && !IS_STRING(value) && !IS_ROPE(value))
+
+void rememberObject(Object *object, VM *vm);
+void tenureObject(Object *object, VM *vm);
+
+/* Has to be called after storing a reference into an object that might be old, so the minor
+   collector knows to look inside it. Stores into the stack and globals don't need it, those
+   are roots. */
+static inline void writeBarrier(Object *object, VM *vm) {
+  if (object->mark != 0 && !object->isRemembered) rememberObject(object, vm);
+}
+
 ObjFunction *newFunction(VM *vm);
 ObjClosure *newClosure(ObjFunction *function, VM *vm);
 ObjUpvalue *newUpvalue(Value *slot, VM *vm);
 ObjNative *newNative(libFn function, VM *vm);
+char *objectTypeName(ObjType type);
 ObjArray *newArrayObject(VM *vm);
 ObjTable *newTableObject(VM *vm);
+ObjShape *newRootShape(VM *vm);
+int shapeLookup(ObjShape *shape, ObjString *key);
+void shapeRemoveWhite(ObjShape *shape, VM *vm);
+void shapeRemoveDead(ObjShape *shape, VM *vm);
 void setInArrayObject(ObjArray *array, Value index, Value value, VM *vm);
 Value getFromArrayObject(ObjArray *array, Value index);
+void appendToArrayObject(ObjArray *array, Value value, VM *vm);
+int arrayObjectCount(ObjArray *array);
+Value arrayObjectAt(ObjArray *array, int index);
+int packArrayObject(ObjArray *array, VM *vm);
 void setInTableObject(ObjTable *table, ObjString *key, Value value, VM *vm);
-Value getFromTableObject(ObjTable *table, ObjString *key);
-int tableObjectGetN(ObjTable *table, Value number, Value *value, Value *key);
+Value getFromTableObject(ObjTable *table, ObjString *key, VM *vm);
+Value getFromTableObjectMiss(ObjTable *table, ObjString *key, InlineCache *cache, VM *vm);
+void setInTableObjectMiss(ObjTable *table, ObjString *key, Value value, InlineCache *cache, VM *vm);
+void tableObjectToDictionary(ObjTable *table, VM *vm);
+void makeTableObjectWeak(ObjTable *table, int weak, VM *vm);
+void tableObjectGrowSlots(ObjTable *table, int count, VM *vm);
+void releaseTableSlots(TableSlots *slots, int capacity, VM *vm);
+ObjTable *cloneTableObject(ObjTable *source, VM *vm);
+Value bindMethod(ObjTable *table, int slot, VM *vm);
+void bindAllMethods(ObjTable *table, VM *vm);
+void releasePendingMethods(ObjTable *table, VM *vm);
+int tableObjectCount(ObjTable *table);
+int tableObjectNext(ObjTable *table, int *cursor, ObjString **key, Value *value, VM *vm);
+void printTableObject(ObjTable *table);
+char *reserveString(int length, VM *vm);
 ObjString *takeString(char *chars, int length, VM *vm);
 ObjString *copyString(char *chars, int length, VM *vm);
+ObjRope *newRope(Object *left, Object *right, VM *vm);
+ObjString *flattenRope(ObjRope *rope, VM *vm);
 void printObject(Value object);
+
+/* The hit paths of the inline caches are here so the VM can inline them into its run loop.
+   A table in dictionary mode has no shape, which never matches an empty way. */
+static inline Value getFromTableObjectCached(ObjTable *table, ObjString *key, InlineCache *cache, VM *vm) {
+  ObjShape *shape = table->shape;
+  if (shape != NULL) {
+    for (int i = 0; i < INLINE_CACHE_WAYS; i++) {
+      InlineCacheEntry *entry = &cache->entries[i];
+      if (entry->shape != shape) continue;
+      Value value = table->slots->values[entry->slot];
+      if (table->pending != NULL && IS_CLOSURE(value)) return bindMethod(table, entry->slot, vm);
+      return value;
+    }
+  }
+  return getFromTableObjectMiss(table, key, cache, vm);
+}
+
+static inline void setInTableObjectCached(ObjTable *table, ObjString *key, Value value, InlineCache *cache, VM *vm) {
+  ObjShape *shape = table->shape;
+  if (shape != NULL) {
+    for (int i = 0; i < INLINE_CACHE_WAYS; i++) {
+      InlineCacheEntry *entry = &cache->entries[i];
+      if (entry->shape != shape) continue;
+      if (table->pending != NULL && IS_CLOSURE(value)) bindAllMethods(table, vm);
+      if (entry->transition != NULL && table->slotCapacity < entry->transition->slotCount) {
+	tableObjectGrowSlots(table, entry->transition->slotCount, vm);
+      } else if (table->slots->refCount > 1) {
+	tableObjectGrowSlots(table, table->slotCapacity, vm);
+      }
+      table->slots->values[entry->slot] = value;
+      if (entry->transition != NULL) table->shape = entry->transition;
+      writeBarrier((Object *)table, vm);
+      return;
+    }
+  }
+  setInTableObjectMiss(table, key, value, cache, vm);
+}
 #endif
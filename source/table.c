@@ -3,6 +3,9 @@
 #include <stdlib.h>
 #include <stddef.h>
 #include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "config.h"
 #include "memory.h"
@@ -10,108 +13,222 @@
 #include "value.h"
 #include "table.h"
 
-#define TOMBSTONE_VAL ((Value) {VAL_NIL, {.number = 1}})
-#define IS_TOMBSTONE(value) (value.type == VAL_NIL && value.as.number == 1)
+/* The entries are kept in the order their keys were added, deleted ones included until the
+   table is rebuilt, and looking keys up goes through an index: a hash table of positions in
+   the entries array, as bytes while the table is small and wider ints once it isn't. Next to the
+   index is an array of control bytes, one per index slot. A used slot's byte holds the top 7 bits
+   of its key's hash, so probing compares a whole group of bytes against that at once and only
+   looks at the entries that match. The slot comes from the low bits, so keys that share a home
+   slot still mostly have different tags. Empty and deleted slots have the high bit set. The first
+   TABLE_GROUP - 1 bytes are repeated after the end, so a group can start at any slot. */
+#define TABLE_GROUP 16
+#define CONTROL_EMPTY 0x80
+#define CONTROL_DELETED 0xfe
+#define HASH_TAG(hash) ((uint8_t)((hash) >> 25))
+
+#define CONTROL_SIZE(capacity) ((capacity) + TABLE_GROUP - 1)
+#define INDEX_WIDTH(capacity) ((capacity) <= 256 ? 1 : (capacity) <= 65536 ? 2 : 4)
+#define INDEX_SIZE(capacity) ((size_t)INDEX_WIDTH(capacity) * (capacity) + CONTROL_SIZE(capacity))
+/* How many entries an index of 'capacity' slots can take. */
+#define MAX_ENTRIES(capacity) ((int)((capacity) * TABLE_MAX_LOAD_FACTOR))
+#define CONTROL(indices, capacity) ((uint8_t *)(indices) + (size_t)INDEX_WIDTH(capacity) * (capacity))
+
+/* Bit i is set for each byte i of the group that equals 'tag'. */
+static uint32_t matchTag(uint8_t *group, uint8_t tag) {
+#ifdef __SSE2__
+  __m128i bytes = _mm_loadu_si128((__m128i *)group);
+  return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8((char)tag)));
+#else
+  uint32_t mask = 0;
+  for (int i = 0; i < TABLE_GROUP; i++) {
+    if (group[i] == tag) mask |= 1u << i;
+  }
+  return mask;
+#endif
+}
+
+/* Bit i is set for each byte i of the group that isn't a used slot, empty or deleted. */
+static uint32_t matchFree(uint8_t *group) {
+#ifdef __SSE2__
+  return (uint32_t)_mm_movemask_epi8(_mm_loadu_si128((__m128i *)group));
+#else
+  uint32_t mask = 0;
+  for (int i = 0; i < TABLE_GROUP; i++) {
+    if (group[i] & 0x80) mask |= 1u << i;
+  }
+  return mask;
+#endif
+}
+
+static int lowestBit(uint32_t mask) {
+#ifdef __GNUC__
+  return __builtin_ctz(mask);
+#else
+  int bit = 0;
+  while (!(mask & 1)) {
+    mask >>= 1;
+    bit++;
+  }
+  return bit;
+#endif
+}
+
+/* Sets a slot's control byte, and its copies past the end. Indexes smaller than a group have
+   their bytes repeated over and over. */
+static void setControl(uint8_t *control, int capacity, int slot, uint8_t byte) {
+  for (int i = slot; i < CONTROL_SIZE(capacity); i += capacity) {
+    control[i] = byte;
+  }
+}
+
+static int getIndex(void *indices, int capacity, int slot) {
+  switch (INDEX_WIDTH(capacity)) {
+  case 1: return ((uint8_t *)indices)[slot];
+  case 2: return ((uint16_t *)indices)[slot];
+  default: return (int)((uint32_t *)indices)[slot];
+  }
+}
+
+static void setIndex(void *indices, int capacity, int slot, int index) {
+  switch (INDEX_WIDTH(capacity)) {
+  case 1: ((uint8_t *)indices)[slot] = (uint8_t)index; break;
+  case 2: ((uint16_t *)indices)[slot] = (uint16_t)index; break;
+  default: ((uint32_t *)indices)[slot] = (uint32_t)index; break;
+  }
+}
 
 void initTable(Table *table) {
-  table->capacity = 0;
   table->count = 0;
+  table->entryCapacity = 0;
+  table->capacity = 0;
   table->entries = NULL;
+  table->indices = NULL;
 }
 
 void freeTable(Table *table, VM *vm) {
-  FREE_ARRAY(Entry, table->entries, table->capacity, vm);
+  FREE_ARRAY(Entry, table->entries, table->entryCapacity, vm);
+  if (table->indices != NULL) reallocate(table->indices, INDEX_SIZE(table->capacity), 0, vm);
   initTable(table);
 }
 
-static Entry *findEntry(Entry *entries, int capacity, ObjString *key) {
-  uint32_t index = key->hash & (capacity - 1);
-  Entry *tombstone = NULL;
-  
+/* The index slot holding the key, or -1 if it isn't in the table. */
+static int findSlot(Table *table, ObjString *key) {
+  uint8_t *control = CONTROL(table->indices, table->capacity);
+  uint32_t slot = key->hash & (table->capacity - 1);
+  uint8_t tag = HASH_TAG(key->hash);
+
   while (1) {
-    Entry *entry = &entries[index];
-    if (entry->key == NULL) {
-      if (IS_TOMBSTONE(entry->value)) {
-	if (tombstone == NULL) tombstone = entry; /* If it's a tombstone, keep going */
-      } else {
-	return tombstone != NULL ? tombstone : entry; /* if not, return a tombstone if you found it. Otherwise, return empty entry */
-      }
-    } else if (entry->key == key) {
-      return entry; /* Found it */
+    uint8_t *group = control + slot;
+    for (uint32_t match = matchTag(group, tag); match != 0; match &= match - 1) {
+      uint32_t candidate = (slot + lowestBit(match)) & (table->capacity - 1);
+      if (table->entries[getIndex(table->indices, table->capacity, candidate)].key == key) return candidate;
     }
-    
-    index = (index + 1) & (capacity - 1);
+    if (matchTag(group, CONTROL_EMPTY) != 0) return -1;
+
+    slot = (slot + TABLE_GROUP) & (table->capacity - 1);
   }
 }
 
-static void adjustCapacity(Table *table, int capacity, VM *vm) {
-  Entry *entries = ALLOCATE(Entry, capacity, vm);
-  for (int i = 0; i < capacity; i++) {
-    entries[i].key = NULL;
-    entries[i].value = NIL_VAL;
+/* The key's entry, or -1 if it isn't in the table. Most keys sit in the slot their hash puts them
+   in, which is checked before going through whole groups. */
+static int findEntry(Table *table, ObjString *key) {
+  uint32_t home = key->hash & (table->capacity - 1);
+  if (CONTROL(table->indices, table->capacity)[home] == HASH_TAG(key->hash)) {
+    int index = getIndex(table->indices, table->capacity, home);
+    if (table->entries[index].key == key) return index;
   }
 
+  int slot = findSlot(table, key);
+  return slot >= 0 ? getIndex(table->indices, table->capacity, slot) : -1;
+}
+
+/* Where a new key goes, the first empty or deleted slot on its way. */
+static int findFree(uint8_t *control, int capacity, uint32_t hash) {
+  uint32_t slot = hash & (capacity - 1);
+  while (1) {
+    uint32_t available = matchFree(control + slot);
+    if (available != 0) return (slot + lowestBit(available)) & (capacity - 1);
+
+    slot = (slot + TABLE_GROUP) & (capacity - 1);
+  }
+}
+
+/* Drops the deleted entries and builds a new index, twice the size unless enough of the entries
+   were deleted ones. */
+static void rebuildTable(Table *table, VM *vm) {
+  int live = 0;
+  for (int i = 0; i < table->count; i++) {
+    if (table->entries[i].key != NULL) live++;
+  }
+  int capacity = table->capacity;
+  if (capacity == 0 || live + 1 > MAX_ENTRIES(capacity) / 2) capacity = GROW_CAPACITY(capacity);
+
+  void *indices = reallocate(NULL, 0, INDEX_SIZE(capacity), vm);
+  uint8_t *control = CONTROL(indices, capacity);
+  memset(indices, 0, (size_t)INDEX_WIDTH(capacity) * capacity);
+  memset(control, CONTROL_EMPTY, CONTROL_SIZE(capacity));
+
   int count = 0;
-  for (int i = 0; i < table->capacity; i++) {
+  for (int i = 0; i < table->count; i++) {
     Entry *entry = &table->entries[i];
     if (entry->key == NULL) continue;
 
-    Entry *dest = findEntry(entries, capacity, entry->key);
-    count++;
-    dest->key = entry->key;
-    dest->value = entry->value;
+    int slot = findFree(control, capacity, entry->key->hash);
+    setControl(control, capacity, slot, HASH_TAG(entry->key->hash));
+    setIndex(indices, capacity, slot, count);
+    table->entries[count++] = *entry;
   }
 
-  FREE_ARRAY(Entry, table->entries, table->capacity, vm);
-  table->entries = entries;
+  if (table->indices != NULL) reallocate(table->indices, INDEX_SIZE(table->capacity), 0, vm);
+  table->indices = indices;
   table->count = count;
   table->capacity = capacity;
 }
 
-int tableSet(Table *table, ObjString *key, Value value, VM *vm) {
-  if (table->count + 1 > table->capacity * TABLE_MAX_LOAD_FACTOR) {
-    int capacity = GROW_CAPACITY(table->capacity);
-    adjustCapacity(table, capacity, vm);
+/* Makes room for one more entry. The entries array grows on its own, so a table with a key or
+   two doesn't pay for the entries its index could take. */
+static void reserveEntry(Table *table, VM *vm) {
+  if (table->count + 1 > MAX_ENTRIES(table->capacity)) rebuildTable(table, vm);
+  if (table->count + 1 > table->entryCapacity) {
+    int entryCapacity = table->entryCapacity < 2 ? 2 : table->entryCapacity * 2;
+    if (entryCapacity > MAX_ENTRIES(table->capacity)) entryCapacity = MAX_ENTRIES(table->capacity);
+    table->entries = GROW_ARRAY(Entry, table->entries, table->entryCapacity, entryCapacity, vm);
+    table->entryCapacity = entryCapacity;
   }
-
-  Entry *entry = findEntry(table->entries, table->capacity, key);
-  int isNewKey = entry->key == NULL;
-  if (isNewKey && IS_NIL(entry->value)) table->count++;
-
-  entry->key = key;
-  entry->value = value;
-  return isNewKey;
 }
 
-int tableGet(Table *table, ObjString *key, Value *value) {
-  if (table->count == 0) return 0;
-
-  Entry *entry = findEntry(table->entries, table->capacity, key);
-  if (entry->key == NULL) return 0;
+int tableSet(Table *table, ObjString *key, Value value, VM *vm) {
+  if (table->count > 0) {
+    int index = findEntry(table, key);
+    if (index >= 0) {
+      table->entries[index].value = value;
+      return 0;
+    }
+  }
 
-  *value = entry->value;
+  reserveEntry(table, vm);
+  uint8_t *control = CONTROL(table->indices, table->capacity);
+  int slot = findFree(control, table->capacity, key->hash);
+  setControl(control, table->capacity, slot, HASH_TAG(key->hash));
+  setIndex(table->indices, table->capacity, slot, table->count);
+  table->entries[table->count].key = key;
+  table->entries[table->count].value = value;
+  table->count++;
   return 1;
 }
 
-int tableGetN(Table *table, int number, Value *value, Value *key) {
+int tableGet(Table *table, ObjString *key, Value *value) {
   if (table->count == 0) return 0;
-  Entry *entry;
-  int j = 0;
-  for (int i = 0; i < number; i++) {
-    while (table->entries[j].key == NULL && j < table->capacity) {
-      j++;
-    }
-    entry = &table->entries[j];
-    j++;
-  }
 
-  *value = entry->value;
-  *key = OBJECT_VAL(entry->key);
+  int index = findEntry(table, key);
+  if (index < 0) return 0;
+
+  *value = table->entries[index].value;
   return 1;
 }
 
 void tableAddAll(Table *from, Table *to, VM *vm) {
-  for (int i = 0; i < from->capacity; i++) {
+  for (int i = 0; i < from->count; i++) {
     Entry *entry = &from->entries[i];
     if (entry->key != NULL) {
       tableSet(to, entry->key, entry->value, vm);
@@ -119,40 +236,57 @@ void tableAddAll(Table *from, Table *to, VM *vm) {
   }
 }
 
+/* The slot is left deleted rather than empty, so probing goes past it to the keys after it, and
+   the entry stays where it is until the next rebuild so the others keep their order. */
 int tableDelete(Table *table, ObjString *key) {
   if (table->count == 0) return 0;
 
-  Entry *entry = findEntry(table->entries, table->capacity, key);
-  if (entry->key == NULL) return 0;
+  int slot = findSlot(table, key);
+  if (slot < 0) return 0;
 
+  Entry *entry = &table->entries[getIndex(table->indices, table->capacity, slot)];
+  setControl(CONTROL(table->indices, table->capacity), table->capacity, slot, CONTROL_DELETED);
   entry->key = NULL;
-  entry->value = TOMBSTONE_VAL;
+  entry->value = NIL_VAL;
   return 1;
 }
 
 ObjString *tableFindString(Table *table, char *chars, int length, uint32_t hash) {
   if (table->count == 0) return NULL;
 
-  uint32_t index = hash & (table->capacity - 1);
+  uint8_t *control = CONTROL(table->indices, table->capacity);
+  uint32_t slot = hash & (table->capacity - 1);
+  uint8_t tag = HASH_TAG(hash);
   while (1) {
-    Entry *entry = &table->entries[index];
-    if (entry->key == NULL) { /* If key is null, check for tombstone, if none found, return NULL */
-      if (!IS_TOMBSTONE(entry->value)) return NULL;
-    } else if (entry->key->length == length	\
-	       && entry->key->hash == hash &&	\
-	       memcmp(entry->key->chars, chars, length) == 0) {
-      /* Found it :) */
-      return entry->key;
+    uint8_t *group = control + slot;
+    for (uint32_t match = matchTag(group, tag); match != 0; match &= match - 1) {
+      int index = getIndex(table->indices, table->capacity, (slot + lowestBit(match)) & (table->capacity - 1));
+      ObjString *key = table->entries[index].key;
+      if (key->length == length && key->hash == hash && memcmp(key->chars, chars, length) == 0) {
+	return key; /* Found it :) */
+      }
     }
+    if (matchTag(group, CONTROL_EMPTY) != 0) return NULL;
 
-    index = (index + 1) & (table->capacity - 1);
+    slot = (slot + TABLE_GROUP) & (table->capacity - 1);
   }
 }
 
-void tableRemoveWhite(Table *table) {
-  for (int i = 0; i < table->capacity; i++) {
+void tableRemoveWhite(Table *table, VM *vm) {
+  for (int i = 0; i < table->count; i++) {
     Entry *entry = &table->entries[i];
-    if (entry->key != NULL && !entry->key->obj.isMarked) {
+    if (entry->key != NULL && !IS_MARKED(&entry->key->obj, vm)) {
+      tableDelete(table, entry->key);
+    }
+  }
+}
+
+/* Like tableRemoveWhite(), but for a weak table's values, see HOLDS_WEAKLY(). */
+void tableRemoveWeak(Table *table, VM *vm) {
+  for (int i = 0; i < table->count; i++) {
+    Entry *entry = &table->entries[i];
+    if (entry->key == NULL) continue;
+    if (HOLDS_WEAKLY(entry->value) && !IS_MARKED(AS_OBJECT(entry->value), vm)) {
       tableDelete(table, entry->key);
     }
   }
@@ -161,8 +295,7 @@ void tableRemoveWhite(Table *table) {
 void printTable(Table *table) {
   printf(":[ ");
   int entryCount = 0;
-  for (int i = 0; i < table->capacity; i++) {
-    
+  for (int i = 0; i < table->count; i++) {
     Entry *entry = &table->entries[i];
     if (entry->key != NULL) {
       if (entryCount > 0) {
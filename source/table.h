@@ -12,21 +12,24 @@ typedef struct {
   Value value;
 } Entry;
 
+/* Go through a table's entries from 0 to count to see its keys in the order they were added. */
 typedef struct {
-  int count;
-  int capacity;
-  Entry *entries;
+  int count; /* Entries used so far, deleted ones included. */
+  int entryCapacity;
+  int capacity; /* Slots in the index, see table.c. */
+  Entry *entries; /* Deleted entries have a NULL key. */
+  void *indices; /* Followed by the control bytes, see table.c. */
 } Table;
   
 void initTable(Table *table);
 void freeTable(Table *table, VM *vm);
 int tableSet(Table *table, ObjString *key, Value value, VM *vm);
 int tableGet(Table *table, ObjString *key, Value *value);
-int tableGetN(Table *table, int number, Value *value, Value *key);
 int tableDelete(Table *table, ObjString *key);
 ObjString *tableFindString(Table *table, char *chars, int length, uint32_t hash);
 void tableAddAll(Table *from, Table *to, VM *vm);
-void tableRemoveWhite(Table *table);
+void tableRemoveWhite(Table *table, VM *vm);
+void tableRemoveWeak(Table *table, VM *vm);
 void printTable(Table *table);
 
 #endif
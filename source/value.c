@@ -6,9 +6,9 @@
 #include "value.h"
 
 void printValue(Value value) {
-  switch (value.type) {
+  switch (VALUE_TYPE(value)) {
   case VAL_NIL: printf("nil"); break;
-  case VAL_LOGIC: switch (value.as.logic) {
+  case VAL_LOGIC: switch (AS_LOGIC(value)) {
     case TRILOX_FALSE: printf("false"); break;
     case TRILOX_UNKNOWN: printf("unknown"); break;
     case TRILOX_TRUE: printf("true"); break;
@@ -50,3 +50,95 @@ void freeValueArray(ValueArray *array, VM *vm) {
   initValueArray(array);
 }
 
+void initNumberArray(NumberArray *array) {
+  array->count = 0;
+  array->capacity = 0;
+  array->values = NULL;
+}
+
+void writeNumberArray(NumberArray *array, double number, VM *vm) {
+  if (array->capacity < array->count + 1) {
+    int oldCapacity = array->capacity;
+    array->capacity = GROW_CAPACITY(oldCapacity);
+    array->values = GROW_ARRAY(double, array->values, oldCapacity, array->capacity, vm);
+  }
+
+  array->values[array->count] = number;
+  array->count++;
+}
+
+double getFromNumberArray(NumberArray *array, int slot) {
+  if (slot >= array->count) {
+    fprintf(stderr, "Out of bounds read of value array.\n");
+    exit(1);
+  }
+
+  return array->values[slot];
+}
+
+void freeNumberArray(NumberArray *array, VM *vm) {
+  FREE_ARRAY(double, array->values, array->capacity, vm);
+  initNumberArray(array);
+}
+
+void initSparseArray(SparseArray *array) {
+  array->count = 0;
+  array->used = 0;
+  array->capacity = 0;
+  array->entries = NULL;
+}
+
+/* Fibonacci hashing, but the mask keeps the low bits, and multiplying leaves the trailing zeros of
+   indexes like i * 1024 where they were. Folding the high half of the product down fills them in. */
+static SparseEntry *findSparseEntry(SparseEntry *entries, int capacity, int index) {
+  uint32_t hash = (uint32_t)index * 2654435769u;
+  uint32_t slot = (hash ^ (hash >> 16)) & (capacity - 1);
+  for (;;) {
+    SparseEntry *entry = &entries[slot];
+    if (entry->index == index || entry->index == 0) return entry;
+    slot = (slot + 1) & (capacity - 1);
+  }
+}
+
+/* Stores a value at 'index', which starts from 1. Storing past the end makes the array longer. */
+void writeSparseArray(SparseArray *array, int index, Value value, VM *vm) {
+  if (array->used + 1 > array->capacity * TABLE_MAX_LOAD_FACTOR) {
+    int capacity = GROW_CAPACITY(array->capacity);
+    SparseEntry *entries = ALLOCATE(SparseEntry, capacity, vm);
+    for (int i = 0; i < capacity; i++) {
+      entries[i].index = 0;
+    }
+    for (int i = 0; i < array->capacity; i++) {
+      SparseEntry *entry = &array->entries[i];
+      if (entry->index != 0) *findSparseEntry(entries, capacity, entry->index) = *entry;
+    }
+    FREE_ARRAY(SparseEntry, array->entries, array->capacity, vm);
+    array->entries = entries;
+    array->capacity = capacity;
+  }
+
+  SparseEntry *entry = findSparseEntry(array->entries, array->capacity, index);
+  if (entry->index == 0) {
+    entry->index = index;
+    array->used++;
+  }
+  entry->value = value;
+  if (index > array->count) array->count = index;
+}
+
+/* 'slot' starts from 0, like the other arrays. */
+Value getFromSparseArray(SparseArray *array, int slot) {
+  if (slot >= array->count) {
+    fprintf(stderr, "Out of bounds read of value array.\n");
+    exit(1);
+  }
+  if (array->capacity == 0) return NIL_VAL;
+
+  SparseEntry *entry = findSparseEntry(array->entries, array->capacity, slot + 1);
+  return entry->index == 0 ? NIL_VAL : entry->value;
+}
+
+void freeSparseArray(SparseArray *array, VM *vm) {
+  FREE_ARRAY(SparseEntry, array->entries, array->capacity, vm);
+  initSparseArray(array);
+}
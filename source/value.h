@@ -3,29 +3,14 @@
 
 typedef struct Object Object;
 typedef struct ObjString ObjString;
+typedef struct ObjRope ObjRope;
 typedef struct ObjFunction ObjFunction;
 typedef struct ObjArray ObjArray;
 typedef struct ObjTable ObjTable;
+typedef struct ObjShape ObjShape;
 
 typedef struct VM VM;
 
-#define NIL_VAL ((Value){VAL_NIL, {.number = 0}})
-#define IS_NIL(value) ((value).type == VAL_NIL)
-
-#define NUMBER_VAL(value) ((Value) {VAL_NUMBER, {.number = value}})
-#define AS_NUMBER(value) ((value).as.number)
-#define IS_NUMBER(value) ((value).type == VAL_NUMBER)
-
-#define OBJECT_VAL(value) ((Value) {VAL_OBJECT, {.object = (Object *)value}}) /* takes in a pointer to the object, casts it to a generic object pointer. */
-#define AS_OBJECT(value) ((value).as.object) /* Returns pointer */
-#define IS_OBJECT(value) ((value).type == VAL_OBJECT)
-
-#define LOGIC_VAL(value) ((Value) {VAL_LOGIC, {.logic = value}})
-#define AS_LOGIC(value) ((value).as.logic)
-#define IS_LOGIC(value) ((value).type == VAL_LOGIC)
-#define LOGIC_TO_TRILOX(expression) ((expression) ? TRILOX_TRUE : TRILOX_FALSE) /* Converts logical true and false to Trilox true and false. Expects expression that resolves to Boolean */
-#define LOGIC_TO_BOOL(value) ((value) == TRILOX_TRUE) /* Returns 1 if value == TRILOX_TRUE, false in all other cases. Maybe it'll be useful? */
-
 typedef enum {
   VAL_NIL,
   VAL_NUMBER,
@@ -39,6 +24,64 @@ typedef enum {
   TRILOX_TRUE
 } TriloxLogic; /* Have to put it here bc of circular dependency issues. :( */
 
+#ifdef NAN_BOXING
+
+#include <stdint.h>
+#include <string.h>
+
+/* With NAN_BOXING defined, a Value is a single 64 bit word. Numbers are stored as plain doubles,
+   and everything else hides in the payload of a quiet NaN that real arithmetic never produces.
+   Objects set the sign bit and keep their pointer in the low 48 bits, the rest use small tags. */
+
+#define SIGN_BIT ((uint64_t) 0x8000000000000000)
+#define QNAN ((uint64_t) 0x7ffc000000000000)
+
+#define TAG_NIL 1
+#define TAG_FALSE 2 /* TAG_FALSE + TriloxLogic gives the tag for each of the three logic values */
+#define TAG_UNKNOWN 3
+#define TAG_TRUE 4
+#define TAG_UNDEFINED 6 /* Never visible to Trilox code, marks global slots that haven't been defined yet. */
+
+typedef uint64_t Value;
+
+static inline Value numberToValue(double number) {
+  Value value;
+  memcpy(&value, &number, sizeof(double));
+  return value;
+}
+
+static inline double valueToNumber(Value value) {
+  double number;
+  memcpy(&number, &value, sizeof(Value));
+  return number;
+}
+
+#define NIL_VAL ((Value) (QNAN | TAG_NIL))
+#define IS_NIL(value) ((value) == NIL_VAL)
+
+#define NUMBER_VAL(value) numberToValue(value)
+#define AS_NUMBER(value) valueToNumber(value)
+#define IS_NUMBER(value) (((value) & QNAN) != QNAN)
+
+#define OBJECT_VAL(value) ((Value) (SIGN_BIT | QNAN | (uint64_t) (uintptr_t) (value)))
+#define AS_OBJECT(value) ((Object *) (uintptr_t) ((value) & ~(SIGN_BIT | QNAN)))
+#define IS_OBJECT(value) (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
+
+#define LOGIC_VAL(value) ((Value) (QNAN | (uint64_t) (TAG_FALSE + (value))))
+#define AS_LOGIC(value) ((TriloxLogic) (((value) & 7) - TAG_FALSE))
+#define IS_LOGIC(value) ((value) >= LOGIC_VAL(TRILOX_FALSE) && (value) <= LOGIC_VAL(TRILOX_TRUE))
+
+static inline valueType valueTypeOf(Value value) {
+  if (IS_NUMBER(value)) return VAL_NUMBER;
+  if (IS_OBJECT(value)) return VAL_OBJECT;
+  if (IS_LOGIC(value)) return VAL_LOGIC;
+  return VAL_NIL;
+}
+
+#define VALUE_TYPE(value) valueTypeOf(value)
+
+#else
+
 typedef struct {
   valueType type;
   union {
@@ -48,16 +91,67 @@ typedef struct {
   } as;
 } Value;
 
+#define NIL_VAL ((Value){VAL_NIL, {.number = 0}})
+#define IS_NIL(value) ((value).type == VAL_NIL)
+
+#define NUMBER_VAL(value) ((Value) {VAL_NUMBER, {.number = value}})
+#define AS_NUMBER(value) ((value).as.number)
+#define IS_NUMBER(value) ((value).type == VAL_NUMBER)
+
+#define OBJECT_VAL(value) ((Value) {VAL_OBJECT, {.object = (Object *)value}}) /* takes in a pointer to the object, casts it to a generic object pointer. */
+#define AS_OBJECT(value) ((value).as.object) /* Returns pointer */
+#define IS_OBJECT(value) ((value).type == VAL_OBJECT)
+
+#define LOGIC_VAL(value) ((Value) {VAL_LOGIC, {.logic = value}})
+#define AS_LOGIC(value) ((value).as.logic)
+#define IS_LOGIC(value) ((value).type == VAL_LOGIC)
+
+#define VALUE_TYPE(value) ((value).type)
+
+#endif
+
+#define LOGIC_TO_TRILOX(expression) ((expression) ? TRILOX_TRUE : TRILOX_FALSE) /* Converts logical true and false to Trilox true and false. Expects expression that resolves to Boolean */
+#define LOGIC_TO_BOOL(value) ((value) == TRILOX_TRUE) /* Returns 1 if value == TRILOX_TRUE, false in all other cases. Maybe it'll be useful? */
+
 typedef struct {
   int count;
   int capacity;
   Value *values;
 } ValueArray;
 
+/* Laid out like a ValueArray, so the two can share storage. */
+typedef struct {
+  int count;
+  int capacity;
+  double *values;
+} NumberArray;
+
+typedef struct {
+  int index; /* 0 for an unused entry, array indices start from 1. */
+  Value value;
+} SparseEntry;
+
+/* An array that's mostly holes, as a hash table from index to value. Everything up to 'count'
+   that isn't in it is nil. */
+typedef struct {
+  int count;
+  int used;
+  int capacity;
+  SparseEntry *entries;
+} SparseArray;
+
 void printValue(Value value);
 void initValueArray(ValueArray *array);
 void writeValueArray(ValueArray *array, Value value, VM *vm);
 void freeValueArray(ValueArray *array, VM *vm);
 Value getFromValueArray(ValueArray *array, int slot);
+void initNumberArray(NumberArray *array);
+void writeNumberArray(NumberArray *array, double number, VM *vm);
+void freeNumberArray(NumberArray *array, VM *vm);
+double getFromNumberArray(NumberArray *array, int slot);
+void initSparseArray(SparseArray *array);
+void writeSparseArray(SparseArray *array, int index, Value value, VM *vm);
+void freeSparseArray(SparseArray *array, VM *vm);
+Value getFromSparseArray(SparseArray *array, int slot);
 
 #endif
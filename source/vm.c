@@ -13,6 +13,14 @@
 #include "logic.h"
 #include "library.h"
 
+#ifdef NAN_BOXING
+#define UNDEFINED_VAL ((Value) (QNAN | TAG_UNDEFINED))
+#define IS_UNDEFINED(value) ((value) == UNDEFINED_VAL)
+#else
+#define UNDEFINED_VAL ((Value) {VAL_NIL, {.number = 2}})
+#define IS_UNDEFINED(value) (value.type == VAL_NIL && value.as.number == 2)
+#endif
+
 VMStack *getStack(VM *vm) {
   return vm->main_stack;
 }
@@ -37,12 +45,30 @@ static void runtimeError(char *message, VM *vm) {
   dumpStacks(vm);
 }
 
+/* Globals live in a flat array on the VM. The compiler asks for a name's slot when it compiles
+   a global access, so the instructions themselves never have to hash the name. Slots that have
+   been handed out but not defined yet hold UNDEFINED_VAL. */
+int globalSlot(ObjString *name, VM *vm) {
+  Value slot;
+  if (tableGet(&vm->globals, name, &slot)) {
+    return (int) AS_NUMBER(slot);
+  }
+
+  push(vm->main_stack, OBJECT_VAL(name));
+  int index = vm->globalValues.count;
+  writeValueArray(&vm->globalValues, UNDEFINED_VAL, vm);
+  tableSet(&vm->globals, name, NUMBER_VAL(index), vm);
+  pop(vm->main_stack);
+  return index;
+}
+
 void defineNative(char *name, libFn function, VM *vm) {
-  push(vm->main_stack, OBJECT_VAL(copyString(name, (int)strlen(name), vm)));
+  vm->allocatingImmortal++;
+  int slot = globalSlot(copyString(name, (int)strlen(name), vm), vm);
   push(vm->main_stack, OBJECT_VAL(newNative(function, vm)));
-  tableSet(&vm->globals, AS_STRING(vm->main_stack->stack[0]), vm->main_stack->stack[1], vm);
-  pop(vm->main_stack);
+  vm->globalValues.values[slot] = vm->main_stack->stack[0];
   pop(vm->main_stack);
+  vm->allocatingImmortal--;
 }
 
 void resetStacks(VM *vm) {
@@ -65,29 +91,82 @@ void initVM(VM *vm) {
   }
   resetStacks(vm);
 
-  vm->objects = NULL;
+  vm->youngCount = 0;
+  vm->youngCapacity = 0;
+  vm->youngObjects = NULL;
+  vm->largeCount = 0;
+  vm->largeCapacity = 0;
+  vm->largeObjects = NULL;
+  vm->pages = NULL;
+  for (int i = 0; i < GC_SIZE_CLASSES; i++) {
+    vm->freeCells[i] = NULL;
+  }
 
   vm->bytesAllocated = 0;
-  vm->nextGC = GC_DEFAULT_THRESHOLD;
+  vm->nextGC = GC_INITIAL_HEAP;
+  if (GC_MAX_HEAP > 0 && vm->nextGC > GC_MAX_HEAP) vm->nextGC = GC_MAX_HEAP;
+  vm->heapLimitHit = 0;
+  vm->nativeError = NULL;
+  vm->nurseryBytes = 0;
+  vm->minorsSinceMajor = 0;
   
-  vm->grayCount = 0;
-  vm->grayCapacity = 0;
-  vm->grayStack = NULL;
+  vm->gray.count = 0;
+  vm->gray.capacity = 0;
+  vm->gray.objects = NULL;
+  vm->gray.atomic = 0;
+
+  vm->rememberedCount = 0;
+  vm->rememberedCapacity = 0;
+  vm->remembered = NULL;
+
+  vm->pageCount = 0;
+  vm->cellBytes = 0;
+  vm->compactPending = 0;
+
+  vm->weakTableCount = 0;
+  vm->weakTableCapacity = 0;
+  vm->weakTables = NULL;
+
+  vm->immortal = NULL;
+  vm->allocatingImmortal = 0;
+  vm->immortalCode = 1;
+  vm->immortalRootCount = 0;
+  vm->immortalRootCapacity = 0;
+  vm->immortalRoots = NULL;
+
+  vm->gcPhase = GC_IDLE;
+  vm->stepBytes = 0;
+  vm->markColor = 1;
+  vm->sweepPage = NULL;
+  vm->sweepCell = 0;
+  vm->sweepLarge = 0;
+  vm->sweptBytes = 0;
+  memset(&vm->stats, 0, sizeof(GcStats));
 
   initTable(&vm->strings);
   initTable(&vm->globals);
+  initValueArray(&vm->globalValues);
+  vm->rootShape = NULL;
+  vm->rootShape = newRootShape(vm);
   
   //printf("%p, %p, %p\n", vm.main_stack, vm.main_stack->top, vm.main_stack->stack);
   loadNativeLibrary("lib/native/corelib.binlib", vm);
 }
 
 void freeVM(VM *vm) {
+  if (GC_PRINT_STATS) printGcStats(vm, stderr);
   free(vm->main_stack);
   free(vm->call_stack);
-  freeObjects(vm->objects, vm);
-  free(vm->grayStack);
+  freeObjects(vm);
+  free(vm->youngObjects);
+  free(vm->largeObjects);
+  free(vm->gray.objects);
+  free(vm->remembered);
+  free(vm->immortalRoots);
+  free(vm->weakTables);
   freeTable(&vm->strings, vm);
   freeTable(&vm->globals, vm);
+  freeValueArray(&vm->globalValues, vm);
   closeLibraries();
 }
 
@@ -120,6 +199,18 @@ Value peek(int offset, VMStack *stack) {
   return *(stack->top -1 - offset);
 }
 
+/* Swaps a rope on the stack for the flat string it spells out. Anything that looks at what's
+   in a string, instead of just passing it around, goes through this first. */
+static inline void flattenSlot(Value *slot, VM *vm) {
+  if (IS_ROPE(*slot)) {
+    *slot = OBJECT_VAL(flattenRope(AS_ROPE(*slot), vm));
+  }
+}
+
+static inline int isStringLike(Value value) {
+  return IS_STRING(value) || IS_ROPE(value);
+}
+
 static int call(ObjClosure *closure, int argCount, VM *vm, VMStack *vmstack) {
   if (argCount != closure->function->arity) {
     runtimeError("Wrong number of arguments inputted to function", vm);
@@ -145,7 +236,15 @@ static int callValue(Value callee, int argCount, VM *vm, VMStack *vmstack) {
       return call(AS_CLOSURE(callee), argCount, vm, vmstack);
     case OBJ_NATIVE: {
       libFn libfn = AS_NATIVE(callee);
+      for (Value *arg = vmstack->top - argCount; arg < vmstack->top; arg++) {
+	flattenSlot(arg, vm);
+      }
       Value result = wrapLibraryFunc(&libfn, argCount, vmstack->top - argCount, vm);
+      if (vm->nativeError != NULL) {
+	runtimeError(vm->nativeError, vm);
+	vm->nativeError = NULL;
+	return 0;
+      }
       vmstack->top -= argCount + 1;
       push(vmstack, result);
       return 1;
@@ -189,18 +288,29 @@ static void closeUpvalues(Value *last, VM *vm) {
     upvalue->closed = *upvalue->location;
     upvalue->location = &upvalue->closed;
     vm->openUpvalues = upvalue->next;
+    writeBarrier((Object *)upvalue, vm);
   }
 }
 
 static void concatenate(VM *vm, VMStack *vmstack) {
-  ObjString *b = AS_STRING(peek(0, vmstack));
-  ObjString *a = AS_STRING(peek(1, vmstack));
-
-  int length = a->length + b->length;
-  char *chars = ALLOCATE(char, length + 1, vm);
+  Value right = peek(0, vmstack);
+  Value left = peek(1, vmstack);
+  int length = (IS_ROPE(left) ? AS_ROPE(left)->length : AS_STRING(left)->length)
+    + (IS_ROPE(right) ? AS_ROPE(right)->length : AS_STRING(right)->length);
+
+  if (length >= ROPE_MIN_LENGTH || IS_ROPE(left) || IS_ROPE(right)) {
+    ObjRope *rope = newRope(AS_OBJECT(left), AS_OBJECT(right), vm);
+    pop(vmstack);
+    pop(vmstack);
+    push(vmstack, OBJECT_VAL(rope));
+    return;
+  }
+  
+  ObjString *b = AS_STRING(right);
+  ObjString *a = AS_STRING(left);
+  char *chars = reserveString(length, vm);
   memcpy(chars, a->chars, a->length);
   memcpy(chars + a->length, b->chars, b->length);
-  chars[length] = '\0';
 
   ObjString *result = takeString(chars, length, vm);
   pop(vmstack);
@@ -211,38 +321,45 @@ static void concatenate(VM *vm, VMStack *vmstack) {
 static Value duplicateTable(Value table, VM *vm) {
   /* Assume off the bat that the input is actually a table. A dangerous assumption, but we'll make it work. */
   ObjTable *table1 = AS_TABLE(table);
+  if (table1->shape != NULL) return OBJECT_VAL(cloneTableObject(table1, vm));
+
+  /* Dictionaries have nowhere to share their entries from, so they get copied right away. */
   ObjTable *table2 = newTableObject(vm);
+  push(vm->main_stack, OBJECT_VAL(table2));
+  tableObjectToDictionary(table2, vm);
 
-  Value table2Val = OBJECT_VAL(table2);
-  ObjUpvalue *table2Upval = newUpvalue(&table2Val, vm);
-  table2Upval->closed = *table2Upval->location;
+  ObjUpvalue *table2Upval = newUpvalue(NULL, vm);
+  table2Upval->closed = OBJECT_VAL(table2);
   table2Upval->location = &table2Upval->closed;
-  
-  for (int i = 0; i < table1->table.capacity; i++) {
-    Entry *entry = &table1->table.entries[i];
-    if (entry->key != NULL) {
-      Value value;
-      if (IS_CLOSURE(entry->value)) {
-	ObjClosure *closureOld = AS_CLOSURE(entry->value);
-	ObjClosure *closureNew = newClosure(closureOld->function, vm);
-	for (int j = 0; j < closureOld->upvalueCount; j++) {
-	  ObjUpvalue *oldUpvalue = closureOld->upvalues[j];
-	  if (LOGIC_TO_BOOL(valuesEqual(table, *oldUpvalue->location))) {
-	    table2Upval->next = oldUpvalue->next;
-	    closureNew->upvalues[j] = table2Upval;
-	  } else {
-	    closureNew->upvalues[j] = closureOld->upvalues[j];
-	  }
+  push(vm->main_stack, OBJECT_VAL(table2Upval));
+
+  int cursor = 0;
+  ObjString *key;
+  Value value;
+  while (tableObjectNext(table1, &cursor, &key, &value, vm)) {
+    if (IS_CLOSURE(value)) {
+      ObjClosure *closureOld = AS_CLOSURE(value);
+      ObjClosure *closureNew = newClosure(closureOld->function, vm);
+      for (int j = 0; j < closureOld->upvalueCount; j++) {
+	ObjUpvalue *oldUpvalue = closureOld->upvalues[j];
+	if (LOGIC_TO_BOOL(valuesEqual(table, *oldUpvalue->location))) {
+	  closureNew->upvalues[j] = table2Upval;
+	} else {
+	  closureNew->upvalues[j] = closureOld->upvalues[j];
 	}
-	value = OBJECT_VAL(closureNew);
-      } else {
-	value = entry->value;
       }
-      setInTableObject(table2, entry->key, value, vm);
+      value = OBJECT_VAL(closureNew);
     }
+    push(vm->main_stack, value);
+    setInTableObject(table2, key, value, vm);
+    pop(vm->main_stack);
   }
 
-  return table2Val;
+  if (table1->weak != 0) makeTableObjectWeak(table2, table1->weak, vm);
+
+  pop(vm->main_stack);
+  pop(vm->main_stack);
+  return OBJECT_VAL(table2);
 }
 
 static InterpretResult run(VM *vm) {
@@ -252,6 +369,7 @@ static InterpretResult run(VM *vm) {
   uint8_t *codestart = frame->closure->function->chunk.code;
   int codelength = frame->closure->function->chunk.count;
   Value *constants = frame->closure->function->chunk.constants.values;
+  InlineCache *caches = frame->closure->function->chunk.caches;
   
 #define READ_BYTE() (*ip++)
 #define READ_CONSTANT() (constants[READ_BYTE()])
@@ -259,6 +377,7 @@ static InterpretResult run(VM *vm) {
 #define READ_LONG_CONSTANT() (constants[READ_SHORT()])
 #define READ_STRING() AS_STRING(READ_CONSTANT())
 #define READ_LONG_STRING() AS_STRING(READ_LONG_CONSTANT())
+#define READ_CACHE() (&caches[READ_SHORT()])
 #define BINARY_OP(op, stack) do {				     \
     if  (!IS_NUMBER(peek(0, stack)) || !IS_NUMBER(peek(1, stack))) { \
       runtimeError("Operands must be numbers!", vm);		     \
@@ -278,32 +397,132 @@ static InterpretResult run(VM *vm) {
   } while (0)
 
 #define BIN_FUNCTION_LOGIC(func, stack) do {	\
+    flattenSlot(stack->top - 1, vm);		\
+    flattenSlot(stack->top - 2, vm);		\
     Value a = pop(stack);			\
     Value b = pop(stack);			\
     push(stack, LOGIC_VAL(func(b, a)));		\
   } while (0)
     
+  /* Straight-line code can't run off the end of a chunk, since the compiler always closes one
+     with OP_RETURN, so the escape check only needs to happen after an instruction moves ip. */
+#define CHECK_IP() do {							\
+    if (ip - codestart > codelength) {					\
+      runtimeError("VM instruction pointer escaped the frame chunk! 99% chance this is an implimentation error, bug report time!", vm); \
+      return INTERPRET_RUNTIME_ERROR;					\
+    }									\
+  } while (0)
+
+  /* Allocations never fail outright once the heap is over its limit, see checkHeapLimit(), so
+     the error comes out here. Loops and calls are the only ways to keep allocating. */
+#define CHECK_HEAP() do {						\
+    if (vm->heapLimitHit) {						\
+      frame->ip = ip;							\
+      runtimeError("Out of memory, the heap grew past its limit.", vm); \
+      return INTERPRET_RUNTIME_ERROR;					\
+    }									\
+  } while (0)
+
+  /* The only place objects get moved, see compactHeap(). Between instructions nothing but the VM's
+     own structures holds on to an object, and the pointers cached in run()'s locals are into
+     function chunks, which never move. */
+#define SAFEPOINT() do {			\
+    if (vm->compactPending) compactHeap(vm);	\
+  } while (0)
+
+#ifdef JOINT_COMPUTED_GOTO
+  /* Every handler jumps straight to the next one through this table instead of going back
+     around to a single switch, so each handler gets its own indirect branch. */
+  static void *dispatchTable[UINT8_MAX + 1] = {
+    [0 ... UINT8_MAX] = &&TARGET_UNKNOWN,
+    [OP_NIL] = &&TARGET_OP_NIL,
+    [OP_CONSTANT] = &&TARGET_OP_CONSTANT,
+    [OP_CONSTANT_16] = &&TARGET_OP_CONSTANT_16,
+    [OP_PUSH_1] = &&TARGET_OP_PUSH_1,
+    [OP_COLLECT] = &&TARGET_OP_COLLECT,
+    [OP_TABLE_SET] = &&TARGET_OP_TABLE_SET,
+    [OP_TABLE_SET_16] = &&TARGET_OP_TABLE_SET_16,
+    [OP_TABLE_GET] = &&TARGET_OP_TABLE_GET,
+    [OP_TABLE_GET_16] = &&TARGET_OP_TABLE_GET_16,
+    [OP_TABLE_DUPLICATE] = &&TARGET_OP_TABLE_DUPLICATE,
+    [OP_POP] = &&TARGET_OP_POP,
+    [OP_FALSE] = &&TARGET_OP_FALSE,
+    [OP_UNKNOWN] = &&TARGET_OP_UNKNOWN,
+    [OP_TRUE] = &&TARGET_OP_TRUE,
+    [OP_NEGATE] = &&TARGET_OP_NEGATE,
+    [OP_KP_NOT] = &&TARGET_OP_KP_NOT,
+    [OP_KP_AND] = &&TARGET_OP_KP_AND,
+    [OP_KP_OR] = &&TARGET_OP_KP_OR,
+    [OP_KP_XOR] = &&TARGET_OP_KP_XOR,
+    [OP_COMPARE] = &&TARGET_OP_COMPARE,
+    [OP_KP_LESS_THAN] = &&TARGET_OP_KP_LESS_THAN,
+    [OP_KP_LT_EQUAL] = &&TARGET_OP_KP_LT_EQUAL,
+    [OP_KP_GREAT_THAN] = &&TARGET_OP_KP_GREAT_THAN,
+    [OP_KP_GT_EQUAL] = &&TARGET_OP_KP_GT_EQUAL,
+    [OP_KP_EQUAL] = &&TARGET_OP_KP_EQUAL,
+    [OP_KP_NOT_EQUAL] = &&TARGET_OP_KP_NOT_EQUAL,
+    [OP_ADD] = &&TARGET_OP_ADD,
+    [OP_SUBTRACT] = &&TARGET_OP_SUBTRACT,
+    [OP_MULTIPLY] = &&TARGET_OP_MULTIPLY,
+    [OP_DIVIDE] = &&TARGET_OP_DIVIDE,
+    [OP_MODULO] = &&TARGET_OP_MODULO,
+    [OP_EXPONENTIAL] = &&TARGET_OP_EXPONENTIAL,
+    [OP_DEFINE_GLOBAL] = &&TARGET_OP_DEFINE_GLOBAL,
+    [OP_DEFINE_GLOBAL_16] = &&TARGET_OP_DEFINE_GLOBAL_16,
+    [OP_SET_GLOBAL] = &&TARGET_OP_SET_GLOBAL,
+    [OP_GET_GLOBAL] = &&TARGET_OP_GET_GLOBAL,
+    [OP_SET_GLOBAL_16] = &&TARGET_OP_SET_GLOBAL_16,
+    [OP_GET_GLOBAL_16] = &&TARGET_OP_GET_GLOBAL_16,
+    [OP_SET_LOCAL] = &&TARGET_OP_SET_LOCAL,
+    [OP_GET_LOCAL] = &&TARGET_OP_GET_LOCAL,
+    [OP_SET_UPVALUE] = &&TARGET_OP_SET_UPVALUE,
+    [OP_GET_UPVALUE] = &&TARGET_OP_GET_UPVALUE,
+    [OP_CLOSE_UPVALUE] = &&TARGET_OP_CLOSE_UPVALUE,
+    [OP_SET_ARRAY] = &&TARGET_OP_SET_ARRAY,
+    [OP_GET_ARRAY] = &&TARGET_OP_GET_ARRAY,
+    [OP_EACH_NEXT] = &&TARGET_OP_EACH_NEXT,
+    [OP_EACH_NEXT_KEY] = &&TARGET_OP_EACH_NEXT_KEY,
+    [OP_TABLE_CLC_SET] = &&TARGET_OP_TABLE_CLC_SET,
+    [OP_TABLE_CLC_GET] = &&TARGET_OP_TABLE_CLC_GET,
+    [OP_JUMP] = &&TARGET_OP_JUMP,
+    [OP_JUMP_IF_FALSE] = &&TARGET_OP_JUMP_IF_FALSE,
+    [OP_JUMP_IF_UNKNOWN] = &&TARGET_OP_JUMP_IF_UNKNOWN,
+    [OP_JUMP_IF_TRUE] = &&TARGET_OP_JUMP_IF_TRUE,
+    [OP_JUMP_IF_NOT_TRUE] = &&TARGET_OP_JUMP_IF_NOT_TRUE,
+    [OP_JUMP_TABLE_JUMP] = &&TARGET_OP_JUMP_TABLE_JUMP,
+    [OP_LOOP] = &&TARGET_OP_LOOP,
+    [OP_CALL] = &&TARGET_OP_CALL,
+    [OP_CLOSURE] = &&TARGET_OP_CLOSURE,
+    [OP_CLOSURE_16] = &&TARGET_OP_CLOSURE_16,
+    [OP_RETURN] = &&TARGET_OP_RETURN,
+  };
+
+#define VM_CASE(op) TARGET_##op
+#define DISPATCH() goto *dispatchTable[READ_BYTE()]
+
+  DISPATCH();
+  {
+#else
+#define VM_CASE(op) case op
+#define DISPATCH() break
+
   while (1) {
-    if (ip - codestart > codelength) {
-      runtimeError("VM instruction pointer escaped the frame chunk! 99% chance this is an implimentation error, bug report time!", vm);
-       return INTERPRET_RUNTIME_ERROR;
-       }
-    uint8_t instruction = READ_BYTE();
-    switch (instruction) {
-    case OP_NIL: push(vmstack, NIL_VAL); break;
-    case OP_CONSTANT: {
+    switch (READ_BYTE()) {
+#endif
+    VM_CASE(OP_NIL): push(vmstack, NIL_VAL); DISPATCH();
+    VM_CASE(OP_CONSTANT): {
       Value constant = READ_CONSTANT();
       push(vmstack, constant);
-      break;
+      DISPATCH();
     }
-    case OP_CONSTANT_16: {
+    VM_CASE(OP_CONSTANT_16): {
       Value constant = READ_LONG_CONSTANT();
       push(vmstack, constant);
-    } break; /* Use this to expand the constants table. When you get around to it. */
-    case OP_PUSH_1: {
+    } DISPATCH(); /* Use this to expand the constants table. When you get around to it. */
+    VM_CASE(OP_PUSH_1): {
       push(vmstack, NUMBER_VAL(1));
-    } break;
-    case OP_COLLECT: {
+    } DISPATCH();
+    VM_CASE(OP_COLLECT): {
       uint8_t arrayCount = READ_BYTE();
       //printStacks();
       if (!IS_ARRAY(peek(arrayCount, vmstack))) {
@@ -313,47 +532,53 @@ static InterpretResult run(VM *vm) {
       ObjArray *array = AS_ARRAY(peek(arrayCount, vmstack));
       for (int i = 1; i <= arrayCount; i++) { /* Accessing from the top of the stack down would put values in the array in reverse order. 
 						 Doing it this way (hopefully) puts them in the correct order. */
-	writeValueArray(&array->values, peek(arrayCount - i, vmstack), vm);
+	appendToArrayObject(array, peek(arrayCount - i, vmstack), vm);
       }
       //printStacks();
       for (int i = 0; i < arrayCount; i++) {
 	pop(vmstack); /* Get them off the stack after writing everything to the array, bc GC reasons. */
       }
       //printStacks();
-    } break;
-    case OP_TABLE_SET: {
+    } DISPATCH();
+    VM_CASE(OP_TABLE_SET): {
       if (!IS_TABLE(peek(1, vmstack))) {
 	runtimeError("Trying to add an entry to a non-table. This is an implimentation error, get out your bug report!", vm);
 	return INTERPRET_RUNTIME_ERROR;
       }
-      setInTableObject(AS_TABLE(peek(1,vmstack)), READ_STRING(), peek(0, vmstack), vm);
+      ObjString *key = READ_STRING();
+      setInTableObjectCached(AS_TABLE(peek(1,vmstack)), key, peek(0, vmstack), READ_CACHE(), vm);
       pop(vmstack);
-    } break;
-    case OP_TABLE_SET_16: {
+    } DISPATCH();
+    VM_CASE(OP_TABLE_SET_16): {
       if (!IS_TABLE(peek(1, vmstack))) {
 	runtimeError("Trying to add an entry to a non-table. This is an implimentation error, get out your bug report!", vm);
 	return INTERPRET_RUNTIME_ERROR;
       }
-      setInTableObject(AS_TABLE(peek(1,vmstack)), READ_LONG_STRING(), peek(0, vmstack), vm);
+      ObjString *key = READ_LONG_STRING();
+      setInTableObjectCached(AS_TABLE(peek(1,vmstack)), key, peek(0, vmstack), READ_CACHE(), vm);
       pop(vmstack);
-    } break;
-    case OP_TABLE_GET: {
+    } DISPATCH();
+    VM_CASE(OP_TABLE_GET): {
       if (!IS_TABLE(peek(0, vmstack))) {
 	runtimeError("Trying to get an entry from a non-table. This is an implimentation error, get out your bug report!", vm);
 	return INTERPRET_RUNTIME_ERROR;
       }
-      Value value = getFromTableObject(AS_TABLE(peek(0,vmstack)), READ_STRING());
+      ObjString *key = READ_STRING();
+      Value value = getFromTableObjectCached(AS_TABLE(peek(0,vmstack)), key, READ_CACHE(), vm);
       pop(vmstack);
       push(vmstack, value);
-    } break;
-    case OP_TABLE_GET_16: {
+    } DISPATCH();
+    VM_CASE(OP_TABLE_GET_16): {
       if (!IS_TABLE(peek(0, vmstack))) {
 	runtimeError("Trying to get an entry from a non-table. This is an implimentation error, get out your bug report!", vm);
 	return INTERPRET_RUNTIME_ERROR;
       }
-      getFromTableObject(AS_TABLE(peek(0,vmstack)), READ_STRING());
-    } break;
-    case OP_TABLE_DUPLICATE: {
+      ObjString *key = READ_LONG_STRING();
+      Value value = getFromTableObjectCached(AS_TABLE(peek(0,vmstack)), key, READ_CACHE(), vm);
+      pop(vmstack);
+      push(vmstack, value);
+    } DISPATCH();
+    VM_CASE(OP_TABLE_DUPLICATE): {
       if (!IS_TABLE(peek(0, vmstack))) {
 	runtimeError("Trying to duplicate a non-table!", vm);
 	return INTERPRET_RUNTIME_ERROR;
@@ -362,33 +587,33 @@ static InterpretResult run(VM *vm) {
       Value tableNew = duplicateTable(peek(0, vmstack), vm);
       pop(vmstack);
       push(vmstack, tableNew);
-    } break;
-    case OP_POP: pop(vmstack); break;
-    case OP_FALSE: push(vmstack, LOGIC_VAL(TRILOX_FALSE)); break;
-    case OP_UNKNOWN: push(vmstack, LOGIC_VAL(TRILOX_UNKNOWN)); break;
-    case OP_TRUE: push(vmstack, LOGIC_VAL(TRILOX_TRUE)); break;
-    case OP_NEGATE:
+    } DISPATCH();
+    VM_CASE(OP_POP): pop(vmstack); DISPATCH();
+    VM_CASE(OP_FALSE): push(vmstack, LOGIC_VAL(TRILOX_FALSE)); DISPATCH();
+    VM_CASE(OP_UNKNOWN): push(vmstack, LOGIC_VAL(TRILOX_UNKNOWN)); DISPATCH();
+    VM_CASE(OP_TRUE): push(vmstack, LOGIC_VAL(TRILOX_TRUE)); DISPATCH();
+    VM_CASE(OP_NEGATE):
       if (!IS_NUMBER(peek(0, vmstack))) {
 	runtimeError("Operand must be a number!", vm);
 	return INTERPRET_RUNTIME_ERROR;
       }
       push(vmstack, NUMBER_VAL(-AS_NUMBER(pop(vmstack))));
-      break;
-    case OP_KP_NOT: push(vmstack, LOGIC_VAL(valueNot(pop(vmstack)))); break;
-    case OP_KP_AND: BIN_FUNCTION_LOGIC(valuesAnd, vmstack); break;
-    case OP_KP_OR: BIN_FUNCTION_LOGIC(valuesOr, vmstack); break;
-    case OP_KP_XOR: BIN_FUNCTION_LOGIC(valuesXor, vmstack); break;
-    case OP_COMPARE: BIN_FUNCTION_LOGIC(ternaryCompare, vmstack); break;
-    case OP_KP_LESS_THAN: BIN_FUNCTION_LOGIC(valuesLessThan, vmstack); break;
-    case OP_KP_LT_EQUAL: BIN_FUNCTION_LOGIC(valuesLToEqual, vmstack); break;
-    case OP_KP_GREAT_THAN: BIN_FUNCTION_LOGIC(valuesGreaterThan, vmstack); break;
-    case OP_KP_GT_EQUAL: BIN_FUNCTION_LOGIC(valuesGToEqual, vmstack); break;
-    case OP_KP_EQUAL: BIN_FUNCTION_LOGIC(valuesEqual, vmstack); break;
-    case OP_KP_NOT_EQUAL: BIN_FUNCTION_LOGIC(valuesNotEqual, vmstack); break;
-    case OP_ADD: {
-      if (IS_STRING(peek(0, vmstack)) && IS_STRING(peek(1, vmstack))) {
+      DISPATCH();
+    VM_CASE(OP_KP_NOT): push(vmstack, LOGIC_VAL(valueNot(pop(vmstack)))); DISPATCH();
+    VM_CASE(OP_KP_AND): BIN_FUNCTION_LOGIC(valuesAnd, vmstack); DISPATCH();
+    VM_CASE(OP_KP_OR): BIN_FUNCTION_LOGIC(valuesOr, vmstack); DISPATCH();
+    VM_CASE(OP_KP_XOR): BIN_FUNCTION_LOGIC(valuesXor, vmstack); DISPATCH();
+    VM_CASE(OP_COMPARE): BIN_FUNCTION_LOGIC(ternaryCompare, vmstack); DISPATCH();
+    VM_CASE(OP_KP_LESS_THAN): BIN_FUNCTION_LOGIC(valuesLessThan, vmstack); DISPATCH();
+    VM_CASE(OP_KP_LT_EQUAL): BIN_FUNCTION_LOGIC(valuesLToEqual, vmstack); DISPATCH();
+    VM_CASE(OP_KP_GREAT_THAN): BIN_FUNCTION_LOGIC(valuesGreaterThan, vmstack); DISPATCH();
+    VM_CASE(OP_KP_GT_EQUAL): BIN_FUNCTION_LOGIC(valuesGToEqual, vmstack); DISPATCH();
+    VM_CASE(OP_KP_EQUAL): BIN_FUNCTION_LOGIC(valuesEqual, vmstack); DISPATCH();
+    VM_CASE(OP_KP_NOT_EQUAL): BIN_FUNCTION_LOGIC(valuesNotEqual, vmstack); DISPATCH();
+    VM_CASE(OP_ADD): {
+      if (isStringLike(peek(0, vmstack)) && isStringLike(peek(1, vmstack))) {
 	concatenate(vm, vmstack);
-      } else if (IS_NUMBER(peek(0, vmstack)) && IS_NUMBER(peek(0, vmstack))) {
+      } else if (IS_NUMBER(peek(0, vmstack)) && IS_NUMBER(peek(1, vmstack))) {
 	double b = AS_NUMBER(pop(vmstack));
 	double a = AS_NUMBER(pop(vmstack));			
 	push(vmstack, NUMBER_VAL(a + b));
@@ -396,80 +621,82 @@ static InterpretResult run(VM *vm) {
 	runtimeError("Operands must be two numbers or two strings.", vm);
 	return INTERPRET_RUNTIME_ERROR;
       }
-    } break;
-    case OP_SUBTRACT: BINARY_OP(-, vmstack); break;
-    case OP_MULTIPLY: BINARY_OP(*, vmstack); break;
-    case OP_DIVIDE: BINARY_OP(/, vmstack); break;
-    case OP_MODULO: BIN_FUNCTION_OP(fmod, vmstack); break;
-    case OP_EXPONENTIAL: BIN_FUNCTION_OP(pow, vmstack); break;
-    case OP_DEFINE_GLOBAL: {
-      ObjString *name = READ_STRING();
-      tableSet(&vm->globals, name, peek(0, vmstack), vm);
+    } DISPATCH();
+    VM_CASE(OP_SUBTRACT): BINARY_OP(-, vmstack); DISPATCH();
+    VM_CASE(OP_MULTIPLY): BINARY_OP(*, vmstack); DISPATCH();
+    VM_CASE(OP_DIVIDE): BINARY_OP(/, vmstack); DISPATCH();
+    VM_CASE(OP_MODULO): BIN_FUNCTION_OP(fmod, vmstack); DISPATCH();
+    VM_CASE(OP_EXPONENTIAL): BIN_FUNCTION_OP(pow, vmstack); DISPATCH();
+    VM_CASE(OP_DEFINE_GLOBAL): {
+      uint8_t slot = READ_BYTE();
+      vm->globalValues.values[slot] = peek(0, vmstack);
       pop(vmstack);
-      break;
+      DISPATCH();
     }
-    case OP_DEFINE_GLOBAL_16: {
-      ObjString *name = READ_LONG_STRING();
-      tableSet(&vm->globals, name, peek(0, vmstack), vm);
+    VM_CASE(OP_DEFINE_GLOBAL_16): {
+      uint16_t slot = READ_SHORT();
+      vm->globalValues.values[slot] = peek(0, vmstack);
       pop(vmstack);
-    } break;
-    case OP_SET_GLOBAL: {
-      ObjString *name = READ_STRING();
-      if (tableSet(&vm->globals, name, peek(0, vmstack), vm)) {
-	tableDelete(&vm->globals, name);
+    } DISPATCH();
+    VM_CASE(OP_SET_GLOBAL): {
+      uint8_t slot = READ_BYTE();
+      if (IS_UNDEFINED(vm->globalValues.values[slot])) {
 	runtimeError("Tried to assign an undefined variable.", vm);
 	return INTERPRET_RUNTIME_ERROR;
       }
-      break;
+      vm->globalValues.values[slot] = peek(0, vmstack);
+      DISPATCH();
     }
-    case OP_GET_GLOBAL: {
-      ObjString *name = READ_STRING();
-      Value value;
-      if (!tableGet(&vm->globals, name, &value)) {
+    VM_CASE(OP_GET_GLOBAL): {
+      uint8_t slot = READ_BYTE();
+      Value value = vm->globalValues.values[slot];
+      if (IS_UNDEFINED(value)) {
 	runtimeError("Undefined variable.", vm);
 	return INTERPRET_RUNTIME_ERROR;
       }
       push(vmstack, value);
-      break;
+      DISPATCH();
     }
-    case OP_SET_GLOBAL_16: {
-      ObjString *name = READ_LONG_STRING();
-      if (tableSet(&vm->globals, name, peek(0, vmstack), vm)) {
-	tableDelete(&vm->globals, name);
+    VM_CASE(OP_SET_GLOBAL_16): {
+      uint16_t slot = READ_SHORT();
+      if (IS_UNDEFINED(vm->globalValues.values[slot])) {
 	runtimeError("Tried to assign an undefined variable.", vm);
 	return INTERPRET_RUNTIME_ERROR;
       }
-    } break;
-    case OP_GET_GLOBAL_16: {
-      ObjString *name = READ_LONG_STRING();
-      Value value;
-      if (!tableGet(&vm->globals, name, &value)) {
+      vm->globalValues.values[slot] = peek(0, vmstack);
+    } DISPATCH();
+    VM_CASE(OP_GET_GLOBAL_16): {
+      uint16_t slot = READ_SHORT();
+      Value value = vm->globalValues.values[slot];
+      if (IS_UNDEFINED(value)) {
 	runtimeError("Undefined variable.", vm);
 	return INTERPRET_RUNTIME_ERROR;
       }
       push(vmstack, value);
-    } break;
-    case OP_SET_LOCAL: {
+    } DISPATCH();
+    VM_CASE(OP_SET_LOCAL): {
       uint8_t slot = READ_BYTE();
       frame->slots[slot] = peek(0, vmstack);
-    } break;
-    case OP_GET_LOCAL: {
+    } DISPATCH();
+    VM_CASE(OP_GET_LOCAL): {
       uint8_t slot = READ_BYTE();
       push(vmstack, frame->slots[slot]);
-    } break;
-    case OP_SET_UPVALUE: {
+    } DISPATCH();
+    VM_CASE(OP_SET_UPVALUE): {
       uint8_t slot = READ_BYTE();
-      *frame->closure->upvalues[slot]->location = peek(0, vmstack);
-    } break;
-    case OP_GET_UPVALUE: {
+      ObjUpvalue *upvalue = frame->closure->upvalues[slot];
+      *upvalue->location = peek(0, vmstack);
+      writeBarrier((Object *)upvalue, vm);
+    } DISPATCH();
+    VM_CASE(OP_GET_UPVALUE): {
       uint8_t slot = READ_BYTE();
       push(vmstack, *frame->closure->upvalues[slot]->location);
-    } break;
-    case OP_CLOSE_UPVALUE: {
+    } DISPATCH();
+    VM_CASE(OP_CLOSE_UPVALUE): {
       closeUpvalues(vm->main_stack->top - 1, vm);
       pop(vmstack);
-    } break;
-    case OP_SET_ARRAY: {
+    } DISPATCH();
+    VM_CASE(OP_SET_ARRAY): {
       if (!IS_NUMBER(peek(1, vmstack))) {
 	runtimeError("Expected number for array access.", vm);
 	 return INTERPRET_RUNTIME_ERROR;
@@ -485,8 +712,8 @@ static InterpretResult run(VM *vm) {
       setInArrayObject(AS_ARRAY(peek(2, vmstack)), peek(1, vmstack), peek(0, vmstack), vm);
       pop(vmstack);
       pop(vmstack);
-    } break;
-    case OP_GET_ARRAY: {
+    } DISPATCH();
+    VM_CASE(OP_GET_ARRAY): {
       if (!IS_NUMBER(peek(0, vmstack))) {
 	runtimeError("Expected number for array access.", vm);
 	return INTERPRET_RUNTIME_ERROR;
@@ -499,67 +726,60 @@ static InterpretResult run(VM *vm) {
       pop(vmstack);
       pop(vmstack);
       push(vmstack, result);
-    } break;
-    case OP_GET_ARRAY_LOOP: { /* This instruction does everything exactly the same as the 
-				 regular instruction, but it leaves the array on the stack. 
-				 Used in 'in each' loops. */
-      if (!IS_NUMBER(peek(0, vmstack))) {
-	runtimeError("Expected number for array access.", vm);
-	return INTERPRET_RUNTIME_ERROR;
-      }
-
-      Value result;
-      
-      if (IS_ARRAY(peek(1,vmstack))) {
-	result = getFromArrayObject(AS_ARRAY(peek(1, vmstack)), peek(0, vmstack));
-      } else if (IS_TABLE(peek(1,vmstack))) {
-	Value key;
-	tableObjectGetN(AS_TABLE(peek(1, vmstack)), peek(0, vmstack), &result, &key);
-      } else {
-	runtimeError("Trying to do an each loop on something that isn't an array or a table!", vm);
-	return INTERPRET_RUNTIME_ERROR;
-      } /* Check for these errors seperately to make the error messages more clear to the user. */
-      
-      pop(vmstack);
-      push(vmstack, result);
-    } break;
-    case OP_GET_TABLE_LOOP: { /* Like the previous instruction, but it puts both the value
-				 and key on the stack. Also expects only tables*/
-      if (!IS_NUMBER(peek(0, vmstack))) {
-	runtimeError("Expected number for array access.", vm);
-	return INTERPRET_RUNTIME_ERROR;
-      }
-
-      Value result;
-      Value key;
+    } DISPATCH();
+    VM_CASE(OP_EACH_NEXT):
+    VM_CASE(OP_EACH_NEXT_KEY): { /* Steps an each loop forward, or jumps out of it once it's done.
+				    The operand is the slot of the loop's collection, followed by
+				    the cursor and the number of entries a table started out with. */
+      int withKey = ip[-1] == OP_EACH_NEXT_KEY;
+      Value *loop = frame->slots + READ_BYTE();
+      uint16_t offset = READ_SHORT();
 
-      if (IS_TABLE(peek(1,vmstack))) {
-	tableObjectGetN(AS_TABLE(peek(1, vmstack)), peek(0, vmstack), &result, &key);
-      } else {
-	runtimeError("Trying to do a table each loop on something that isn't a table!", vm);
-	return INTERPRET_RUNTIME_ERROR;
+      if (IS_NIL(loop[1])) {
+	if (IS_TABLE(loop[0])) {
+	  loop[2] = NUMBER_VAL(tableObjectCount(AS_TABLE(loop[0])));
+	} else if (withKey) {
+	  runtimeError("Trying to do a table each loop on something that isn't a table!", vm);
+	  return INTERPRET_RUNTIME_ERROR;
+	} else if (!IS_ARRAY(loop[0])) {
+	  runtimeError("Trying to do an each loop on something that isn't an array or a table!", vm);
+	  return INTERPRET_RUNTIME_ERROR;
+	}
+	loop[1] = NUMBER_VAL(0);
       }
 
-      pop(vmstack);
-      push(vmstack, result);
-      push(vmstack, key);
-    } break;
-    case OP_GET_ARRAY_COUNT: {
-
-      Value count;
-      
-      if (IS_ARRAY(peek(0, vmstack))) {
-	count = NUMBER_VAL(AS_ARRAY(peek(0, vmstack))->values.count);
-      } else if (IS_TABLE(peek(0, vmstack))) {
-	count = NUMBER_VAL(AS_TABLE(peek(0, vmstack))->table.count);
+      int cursor = (int) AS_NUMBER(loop[1]);
+      if (IS_ARRAY(loop[0])) {
+	ObjArray *array = AS_ARRAY(loop[0]);
+	if (cursor >= arrayObjectCount(array)) {
+	  ip += offset;
+	  CHECK_IP();
+	  DISPATCH();
+	}
+	loop[1] = NUMBER_VAL(cursor + 1);
+	push(vmstack, arrayObjectAt(array, cursor));
       } else {
-	runtimeError("Trying to get the count of something that isn't an array!", vm);
-	printValue(peek(0, vmstack));
-	return INTERPRET_RUNTIME_ERROR;
+	/* Adding keys can rehash a table out from under the cursor, so it isn't allowed mid-loop.
+	   Assigning to keys that are already there is fine. */
+	ObjTable *table = AS_TABLE(loop[0]);
+	if (tableObjectCount(table) != (int) AS_NUMBER(loop[2])) {
+	  runtimeError("Table changed size during an each loop.", vm);
+	  return INTERPRET_RUNTIME_ERROR;
+	}
+	ObjString *key;
+	Value value;
+	if (!tableObjectNext(table, &cursor, &key, &value, vm)) {
+	  ip += offset;
+	  CHECK_IP();
+	  DISPATCH();
+	}
+	loop[1] = NUMBER_VAL(cursor);
+	push(vmstack, value);
+	if (withKey) push(vmstack, OBJECT_VAL(key));
       }
-      push(vmstack, count);
-    } break;
-    case OP_TABLE_CLC_SET: {
+    } DISPATCH();
+    VM_CASE(OP_TABLE_CLC_SET): {
+      flattenSlot(vmstack->top - 2, vm);
       if (!IS_STRING(peek(1, vmstack))) {
 	runtimeError("Expected string for table access.", vm);
 	return INTERPRET_RUNTIME_ERROR;
@@ -569,11 +789,18 @@ static InterpretResult run(VM *vm) {
 	return INTERPRET_RUNTIME_ERROR;
       }
 
-      setInTableObject(AS_TABLE(peek(2, vmstack)), AS_STRING(peek(1, vmstack)), peek(0, vmstack), vm);
+      ObjTable *table = AS_TABLE(peek(2, vmstack));
+      ObjString *key = AS_STRING(peek(1, vmstack));
+      if (table->shape != NULL && shapeLookup(table->shape, key) == -1) {
+	/* Tables that grow keys at runtime are being used as maps, keep them out of the shape tree. */
+	tableObjectToDictionary(table, vm);
+      }
+      setInTableObject(table, key, peek(0, vmstack), vm);
       pop(vmstack);
       pop(vmstack);
-    } break;
-    case OP_TABLE_CLC_GET: {
+    } DISPATCH();
+    VM_CASE(OP_TABLE_CLC_GET): {
+      flattenSlot(vmstack->top - 1, vm);
       if (!IS_STRING(peek(0, vmstack))) {
 	runtimeError("Expected string for table access.", vm);
 	return INTERPRET_RUNTIME_ERROR;
@@ -582,61 +809,73 @@ static InterpretResult run(VM *vm) {
 	runtimeError("Trying to do a table access on something that isn't a table!", vm);
 	return INTERPRET_RUNTIME_ERROR;
       }
-      Value result = getFromTableObject(AS_TABLE(peek(1, vmstack)), AS_STRING(peek(0, vmstack)));
+      Value result = getFromTableObject(AS_TABLE(peek(1, vmstack)), AS_STRING(peek(0, vmstack)), vm);
       pop(vmstack);
       pop(vmstack);
       push(vmstack, result);
-    } break;
-    case OP_JUMP: {
+    } DISPATCH();
+    VM_CASE(OP_JUMP): {
       uint16_t offset = READ_SHORT();
       ip += offset;
-    } break;
-    case OP_JUMP_IF_FALSE: {
+      CHECK_IP();
+    } DISPATCH();
+    VM_CASE(OP_JUMP_IF_FALSE): {
       uint16_t offset = READ_SHORT();
-      if (valueNot(peek(0, vmstack)) == TRILOX_TRUE) ip += offset; // Checks for negation bc reasons.
-    } break;
-    case OP_JUMP_IF_UNKNOWN: {
+      if (valueNot(peek(0, vmstack)) == TRILOX_TRUE) { // Checks for negation bc reasons.
+	ip += offset;
+	CHECK_IP();
+      }
+    } DISPATCH();
+    VM_CASE(OP_JUMP_IF_UNKNOWN): {
       uint16_t offset = READ_SHORT();
-      if (valueNot(peek(0, vmstack)) == TRILOX_UNKNOWN) ip += offset; // One of the reasons is that it won't mess up when you get a non logical value. 
-    } break;
-    case OP_JUMP_IF_TRUE: {
+      if (valueNot(peek(0, vmstack)) == TRILOX_UNKNOWN) { // One of the reasons is that it won't mess up when you get a non logical value.
+	ip += offset;
+	CHECK_IP();
+      }
+    } DISPATCH();
+    VM_CASE(OP_JUMP_IF_TRUE): {
       uint16_t offset = READ_SHORT();
-      if (valueNot(peek(0, vmstack)) == TRILOX_FALSE) ip += offset;
-    } break;
-    case OP_JUMP_IF_NOT_TRUE: {
+      if (valueNot(peek(0, vmstack)) == TRILOX_FALSE) {
+	ip += offset;
+	CHECK_IP();
+      }
+    } DISPATCH();
+    VM_CASE(OP_JUMP_IF_NOT_TRUE): {
       uint16_t offset = READ_SHORT();
-      if (valueNot(peek(0, vmstack)) != TRILOX_FALSE) ip += offset;
-    } break;
-    case OP_JUMP_TABLE_JUMP: {
-      uint8_t jumpTableNum = READ_BYTE();
-      Table *jumpTable = getJumpTable(&frame->closure->function->chunk, jumpTableNum);
-      Value offsetVal;
-      int isCase = 0;
-      if (IS_STRING(peek(0, vmstack))) {
-      isCase = tableGet(jumpTable, AS_STRING(peek(0, vmstack)), &offsetVal);
-      }
-      if (!isCase) {
-	tableGet(jumpTable, copyString("___internal_switch_default", 26, vm), &offsetVal);
-      }
-      ip += (int) AS_NUMBER(offsetVal);
-    } break;
-    case OP_LOOP: {
+      if (valueNot(peek(0, vmstack)) != TRILOX_FALSE) {
+	ip += offset;
+	CHECK_IP();
+      }
+    } DISPATCH();
+    VM_CASE(OP_JUMP_TABLE_JUMP): {
+      JumpTable *jumpTable = getJumpTable(&frame->closure->function->chunk, READ_BYTE());
+      flattenSlot(vmstack->top - 1, vm);
+      ip += jumpTableOffset(jumpTable, peek(0, vmstack));
+      CHECK_IP();
+    } DISPATCH();
+    VM_CASE(OP_LOOP): {
       uint16_t offset = READ_SHORT();
       ip -= offset;
-    } break;
-    case OP_CALL: {
+      CHECK_IP();
+      CHECK_HEAP();
+      SAFEPOINT();
+    } DISPATCH();
+    VM_CASE(OP_CALL): {
       int argCount = READ_BYTE();
+      CHECK_HEAP();
+      SAFEPOINT();
+      frame->ip = ip; /* Before the call, so an error in it gets the right line. */
       if (!callValue(peek(argCount, vmstack), argCount, vm, vmstack)) {
 	return INTERPRET_RUNTIME_ERROR;
       }
-      frame->ip = ip;
       frame = &vm->call_stack->frames[vm->call_stack->frameCount - 1];
       ip = frame->ip;
       codestart = frame->closure->function->chunk.code;
       codelength = frame->closure->function->chunk.count;
       constants = frame->closure->function->chunk.constants.values;
-    } break;
-    case OP_CLOSURE: {
+      caches = frame->closure->function->chunk.caches;
+    } DISPATCH();
+    VM_CASE(OP_CLOSURE): {
       ObjFunction *function = AS_FUNCTION(READ_CONSTANT());
       ObjClosure *closure = newClosure(function, vm);
       push(vmstack, OBJECT_VAL(closure));
@@ -650,8 +889,9 @@ static InterpretResult run(VM *vm) {
 	  closure->upvalues[i] = frame->closure->upvalues[index];
 	}
       }
-    } break;
-    case OP_CLOSURE_16: {
+      writeBarrier((Object *)closure, vm); /* Capturing can collect, and the closure may be old by now. */
+    } DISPATCH();
+    VM_CASE(OP_CLOSURE_16): {
       ObjFunction *function = AS_FUNCTION(READ_LONG_CONSTANT());
       ObjClosure *closure = newClosure(function, vm);
       push(vmstack, OBJECT_VAL(closure));
@@ -665,8 +905,9 @@ static InterpretResult run(VM *vm) {
 	  closure->upvalues[i] = frame->closure->upvalues[index];
 	}
       }
-    } break;
-    case OP_RETURN: {
+      writeBarrier((Object *)closure, vm); /* Capturing can collect, and the closure may be old by now. */
+    } DISPATCH();
+    VM_CASE(OP_RETURN): {
       Value result = pop(vmstack);
       closeUpvalues(frame->slots, vm);
       vm->call_stack->frameCount--;
@@ -682,12 +923,25 @@ static InterpretResult run(VM *vm) {
       codestart = frame->closure->function->chunk.code;
       codelength = frame->closure->function->chunk.count;
       constants = frame->closure->function->chunk.constants.values;
-    } break;
+      caches = frame->closure->function->chunk.caches;
+    } DISPATCH();
+#ifdef JOINT_COMPUTED_GOTO
+    TARGET_UNKNOWN: return INTERPRET_RUNTIME_ERROR;
+  }
+#else
     default: return INTERPRET_RUNTIME_ERROR;
     }
   }
+#endif
+#undef DISPATCH
+#undef VM_CASE
+#undef CHECK_IP
+#undef CHECK_HEAP
+#undef SAFEPOINT
+#undef BIN_FUNCTION_LOGIC
 #undef BIN_FUNCTION_OP
 #undef BINARY_OP
+#undef READ_CACHE
 #undef READ_LONG_STRING
 #undef READ_STRING
 #undef READ_LONG_CONSTANT
@@ -697,6 +951,7 @@ static InterpretResult run(VM *vm) {
 }
 
 InterpretResult interpret(char *source, char *filename, VM *vm) {
+  vm->heapLimitHit = 0;
   ObjFunction *function = compile(source, filename, vm);
   
   if (function == NULL) {
@@ -8,6 +8,48 @@
 #include "table.h"
 #include "library.h"
 
+/* Where an incremental major collection is up to. Minor collections only run while idle or
+   sweeping, since the other phases need the mark bits to themselves. */
+typedef enum {
+  GC_IDLE,
+  GC_MARKING,
+  GC_SWEEPING,
+} GcPhase;
+
+/* Durations go in power of two buckets, bucket i counts the ones under 2^i microseconds and the
+   last one counts everything longer. */
+typedef struct {
+  uint64_t count;
+  uint64_t totalNanos;
+  uint64_t maxNanos;
+  uint64_t buckets[GC_HISTOGRAM_BUCKETS];
+} GcHistogram;
+
+/* Kept up to date all the time, printed by --gc-stats and read by the gcstats() native. */
+typedef struct {
+  uint64_t minorCollections;
+  uint64_t majorCollections; /* Incremental cycles count once each. */
+  uint64_t bytesFreed;
+  GcHistogram minorPauses;
+  GcHistogram majorPauses; /* Each slice of an incremental cycle is a pause of its own. */
+  GcHistogram markTime;
+  GcHistogram sweepTime; /* Sweeping done a few objects per allocation isn't timed. */
+  GcHistogram purgeTime; /* Pruning dead strings and shapes from the weak tables. */
+  size_t liveObjects[OBJ_TYPE_COUNT];
+  size_t liveBytes[OBJ_TYPE_COUNT]; /* Just the objects, not the arrays they own. */
+  size_t immortalBytes; /* The chunks of the immortal region, counted in bytesAllocated too. */
+  uint64_t compactions;
+  uint64_t pagesReleased; /* Emptied by compaction and handed back. */
+  GcHistogram compactTime;
+} GcStats;
+
+typedef struct {
+  int count;
+  int capacity;
+  Object **objects;
+  int atomic; /* Claim marks with atomic operations, since other threads are marking too. */
+} GrayStack;
+
 typedef struct {
   ObjClosure *closure;
   uint8_t *ip;
@@ -24,6 +66,10 @@ typedef struct {
   CallFrame frames[FRAMES_MAX];
 } CallStack;
 
+typedef struct Page Page;
+typedef struct Region Region;
+typedef struct FreeCell FreeCell;
+
 struct VM {
   VMStack *main_stack;
   CallStack *call_stack;
@@ -31,14 +77,53 @@ struct VM {
 
   size_t bytesAllocated;
   size_t nextGC;
+  int heapLimitHit; /* Still over GC_MAX_HEAP after a full collection, run() raises the error. */
+  char *nativeError; /* Set by a native to stop the script with a runtime error, see callValue(). */
+  size_t nurseryBytes; /* Allocated since the last collection of either kind. */
+  int minorsSinceMajor;
 
-  Object *objects; /* Points to the head of the object linked list */
+  int youngCount; /* New objects, until they survive a collection. */
+  int youngCapacity;
+  Object **youngObjects;
+  int largeCount; /* The old objects too large for a page. Old objects in pages are found in their page. */
+  int largeCapacity;
+  Object **largeObjects;
+  Page *pages;
+  int pageCount;
+  size_t cellBytes; /* How much of the pages is handed out, whole cells. */
+  int compactPending; /* Compaction is due at the next safepoint in run(). */
+  FreeCell *freeCells[GC_SIZE_CLASSES];
+  Region *immortal; /* The chunks of the immortal region, the one being filled first. */
+  int allocatingImmortal; /* Nonzero while new objects go in the immortal region. */
+  int immortalCode; /* Whether compile() puts what it makes there. Off in the REPL, where every line would stay forever. */
   Table strings;
-  Table globals;
+  Table globals; /* Maps global names to their slot in globalValues. */
+  ValueArray globalValues;
+  ObjShape *rootShape; /* The shape of an empty table, every other shape descends from it. */
   
-  int grayCount;
-  int grayCapacity;
-  Object **grayStack;
+  GrayStack gray;
+
+  int rememberedCount; /* Old objects that have been written to since the last collection. */
+  int rememberedCapacity;
+  Object **remembered;
+
+  int weakTableCount; /* Every weak table, pruned after each collection's marking. */
+  int weakTableCapacity;
+  ObjTable **weakTables;
+
+  int immortalRootCount; /* Immortal objects that can point at mortal ones, traced by every major collection. */
+  int immortalRootCapacity;
+  Object **immortalRoots;
+
+  GcPhase gcPhase;
+  uint8_t markColor; /* Flips between 1 and 2 at the start of every major collection. */
+  size_t stepBytes; /* Allocated since the last incremental slice. */
+  Page *sweepPage; /* The lazy sweep goes through the pages first, */
+  int sweepCell;
+  int sweepLarge; /* then the large objects. */
+  size_t sweptBytes; /* Freed so far by the current sweep, for the log. */
+
+  GcStats stats;
 };
 
 //extern VM vm;
@@ -50,6 +135,7 @@ typedef enum {
 } InterpretResult;
 
 void defineNative(char *name, libFn function, VM *vm);
+int globalSlot(ObjString *name, VM *vm);
 VMStack *getStack(VM *vm);
 void dumpStacks(VM *vm);
 void printStacks();